@@ -1,15 +1,92 @@
 #include <ph.h>
 
+#include "cpu_tracer.h"
+#include "ocl_interop_structs.h"
+#include "profiler.h"
+#include "scene.h"
+#include "vr.h"
+
+#include "samples.h"
+
 using namespace ph;
 
 ////////////////////////////////////////
 // Used to check that core constructs
 // work as intended.
+//
+// Built with PH_HEADLESS against the
+// headless library, so it runs without
+// a GPU, a window or a Rift.
 ////////////////////////////////////////
 
+static CLvec3 make_clvec3(float x, float y, float z)
+{
+    CLvec3 v = { x, y, z, 0 };
+    return v;
+}
+
+// Coordinates of `p` in the space of a Woop triangle.
+static glm::vec3 to_woop_space(const CLwoopTriangle& woop, glm::vec3 p)
+{
+    glm::vec3 out;
+    for (int k = 0; k < 3; ++k)
+    {
+        const float* row = woop.rows[k];
+        out[k] = row[0] * p.x + row[1] * p.y + row[2] * p.z + row[3];
+    }
+    return out;
+}
+
+static bool close_to(glm::vec3 a, glm::vec3 b, float tolerance)
+{
+    return glm::length(a - b) <= tolerance;
+}
+
+// Index of the node that follows the subtree of node `i` in depth first order.
+// Walks the tree through right children only, so it does not trust escape offsets.
+static int64 subtree_end(const BVHNode* tree, int64 i)
+{
+    while (tree[i].primitive_offset < 0)
+    {
+        i = get_right_child(tree[i]);
+    }
+    return i + 1;
+}
+
+// Zones of the profiler dump at `path` named `name`, as their begin times.
+static Slice<uint64> read_profile_zones(const char* path, const char* name)
+{
+    Slice<uint64> zones = MakeSlice<uint64>(1024);
+    FILE* fd = fopen(path, "rb");
+    if (!fd)
+    {
+        phatal_error("Could not read the profiler dump");
+    }
+    fseek(fd, 0, SEEK_END);
+    size_t len = (size_t)ftell(fd);
+    fseek(fd, 0, SEEK_SET);
+    char* json = phalloc(char, len + 1);
+    len = fread(json, 1, len, fd);
+    json[len] = '\0';
+    fclose(fd);
+    char key[64];
+    snprintf(key, sizeof(key), "{\"name\":\"%s\",", name);
+    for (const char* c = strstr(json, key); c; c = strstr(c + 1, key))
+    {
+        const char* ts = strstr(c, "\"ts\":");
+        unsigned long long begin_us = 0;
+        if (!ts || sscanf(ts, "\"ts\":%llu", &begin_us) != 1)
+        {
+            phatal_error("Malformed profiler dump");
+        }
+        append(&zones, (uint64)begin_us);
+    }
+    phree(json);
+    return zones;
+}
+
 int main() {
     ph::init();
-    printf("Boehm GC version is %d.%d.%d\n", GC_VERSION_MAJOR, GC_VERSION_MINOR, GC_VERSION_MICRO);
     // Test slices
     {
         // Test append =======================================
@@ -47,7 +124,7 @@ int main() {
     // Test dicts
 #define PH_DEBUG_DICT
     {
-        char* keys[] = {
+        const char* keys[] = {
             "hello",
             "world",
             "i",
@@ -56,19 +133,19 @@ int main() {
             "hash",
             "map",
         };
-        typedef char* charptr;
-        auto dict = ph::MakeDict<char*, int>(50);
-        auto dict1 = ph::MakeDict<char*, int>(1);
-        for (int i = 0; i < sizeof(keys) / sizeof(char*); ++i) {
+        const int num_keys = (int)(sizeof(keys) / sizeof(keys[0]));
+        auto dict = ph::MakeDict<const char*, int>(50);
+        auto dict1 = ph::MakeDict<const char*, int>(1);
+        for (int i = 0; i < num_keys; ++i) {
             logf("%s\n", keys[i]);
             ph::insert(&dict, keys[i], i);
             ph::insert(&dict1, keys[i], i);
         }
-        for (int i = 0; i < sizeof(keys) / sizeof(char*); ++i) {
-            if (!*ph::find(&dict, keys[i]) == i) {
+        for (int i = 0; i < num_keys; ++i) {
+            if (*ph::find(&dict, keys[i]) != i) {
                 phatal_error("Incorrect value for key!");
             }
-            if (!*ph::find(&dict1, keys[i]) == i) {
+            if (*ph::find(&dict1, keys[i]) != i) {
                 phatal_error("Incorrect value for key!");
             }
         }
@@ -84,6 +161,290 @@ int main() {
         printf("Hello world! %d\n", array[5]);
         phree(array);
     }
+
+    // Test normal packing ====================================
+    // Octahedral encoding keeps 16 bits per coordinate: decoded normals are
+    // within about 1e-4 radians, on both halves and across the fold.
+    {
+        int num_checked = 0;
+        for (int i = 0; i <= 32; ++i)
+        {
+            const float theta = 3.14159265f * (float)i / 32;
+            for (int j = 0; j < 64; ++j)
+            {
+                const float phi = 2 * 3.14159265f * (float)j / 64;
+                const glm::vec3 n(sinf(theta) * cosf(phi), sinf(theta) * sinf(phi), cosf(theta));
+                const glm::vec3 decoded = decode_normal(encode_normal(make_clvec3(n.x, n.y, n.z)));
+                if (glm::dot(n, decoded) < 0.99999f)
+                {
+                    printf("Normal (%f %f %f) decodes to (%f %f %f)\n", n.x, n.y, n.z,
+                            decoded.x, decoded.y, decoded.z);
+                    phatal_error("Normal does not survive encode_normal / decode_normal");
+                }
+                ++num_checked;
+            }
+        }
+        CLtriangle norms;
+        norms.p0 = make_clvec3(0, 0, -1);
+        norms.p1 = make_clvec3(1, 0, 0);
+        norms.p2 = make_clvec3(-0.6f, 0, -0.8f);
+        const CLpackedNormals packed = pack_normals(norms);
+        const CLvec3* vertex_norms[3] = { &norms.p0, &norms.p1, &norms.p2 };
+        for (int k = 0; k < 3; ++k)
+        {
+            const CLvec3& n = *vertex_norms[k];
+            if (packed.n[k] != encode_normal(n) ||
+                    !close_to(decode_normal(packed.n[k]), glm::vec3(n.x, n.y, n.z), 1e-4f))
+            {
+                phatal_error("pack_normals does not keep its vertex normals in order");
+            }
+        }
+        printf("Normal packing: %d normals round trip.\n", num_checked);
+    }
+
+    // Test Woop triangles ====================================
+    {
+        CLtriangle tri;
+        tri.p0 = make_clvec3(1, 2, 3);
+        tri.p1 = make_clvec3(4, 2, 3);
+        tri.p2 = make_clvec3(1, 5, 7);
+        const CLwoopTriangle woop = make_woop_triangle(tri);
+        const glm::vec3 p0(1, 2, 3);
+        const glm::vec3 p1(4, 2, 3);
+        const glm::vec3 p2(1, 5, 7);
+        const glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+        if (!close_to(to_woop_space(woop, p0), glm::vec3(0, 0, 0), 1e-4f) ||
+                !close_to(to_woop_space(woop, p1), glm::vec3(1, 0, 0), 1e-4f) ||
+                !close_to(to_woop_space(woop, p2), glm::vec3(0, 1, 0), 1e-4f) ||
+                !close_to(to_woop_space(woop, p0 + normal), glm::vec3(0, 0, 1), 1e-4f))
+        {
+            phatal_error("make_woop_triangle does not map the triangle to the unit triangle");
+        }
+        // The centroid lands inside, at barycentric (1/3, 1/3).
+        const glm::vec3 centroid = to_woop_space(woop, (p0 + p1 + p2) / 3.0f);
+        if (!close_to(centroid, glm::vec3(1 / 3.0f, 1 / 3.0f, 0), 1e-4f))
+        {
+            phatal_error("make_woop_triangle: wrong barycentrics at the centroid");
+        }
+        // Degenerate triangles are never hit: z is 1 everywhere.
+        CLtriangle line;
+        line.p0 = make_clvec3(0, 0, 0);
+        line.p1 = make_clvec3(1, 1, 1);
+        line.p2 = make_clvec3(2, 2, 2);
+        const CLwoopTriangle never = make_woop_triangle(line);
+        if (to_woop_space(never, glm::vec3(5, -3, 2)).z != 1 || to_woop_space(never, p0).z != 1)
+        {
+            phatal_error("make_woop_triangle: degenerate triangle can be hit");
+        }
+        printf("Woop triangles OK.\n");
+    }
+
+    // Test the profiler ring ==================================
+    // A thread keeps its last kRingSize zones. dump() leaves out the oldest one,
+    // which the thread could be overwriting while it reads.
+    {
+        const int64 num_zones = profiler::kRingSize + 1000;
+        for (int64 i = 0; i < num_zones; ++i)
+        {
+            profiler::record("ring_test", (uint64)i, (uint64)i + 1);
+        }
+        const char* path = "ph_test_profile.json";
+        profiler::dump(path);
+        Slice<uint64> zones = read_profile_zones(path, "ring_test");
+        remove(path);
+        if (count(zones) != profiler::kRingSize - 1)
+        {
+            printf("Dumped %ld of the last %ld zones\n", (long)count(zones), (long)profiler::kRingSize);
+            phatal_error("Profiler ring keeps the wrong number of zones");
+        }
+        for (int64 i = 0; i < count(zones); ++i)
+        {
+            if (zones[i] != (uint64)(num_zones - profiler::kRingSize + 1 + i))
+            {
+                phatal_error("Profiler ring dumps the wrong zones, or out of order");
+            }
+        }
+        release(&zones);
+        printf("Profiler ring OK.\n");
+    }
+
+    scene::set_headless();
+
+    // Test flat BVH escape offsets ===========================
+    {
+        // Leaf 1 and the inner node 2, whose leaves are 3 and 4. Escapes: 5 for
+        // the root, and for node 2, whose subtree ends with the tree.
+        BVHNode tree[5] = {};
+        tree[0].primitive_offset = -5;
+        tree[0].right_child_offset = 2;
+        tree[1].primitive_offset = 0;
+        tree[1].right_child_offset = -1;
+        tree[2].primitive_offset = -5;
+        tree[2].right_child_offset = 4;
+        tree[3].primitive_offset = 1;
+        tree[3].right_child_offset = -1;
+        tree[4].primitive_offset = 2;
+        tree[4].right_child_offset = -1;
+        if (!scene::validate_flattened_bvh(tree, 5))
+        {
+            phatal_error("validate_flattened_bvh rejects a valid tree");
+        }
+        tree[2].primitive_offset = -4;
+        if (scene::validate_flattened_bvh(tree, 5))
+        {
+            phatal_error("validate_flattened_bvh accepts a bad escape offset");
+        }
+        tree[2].primitive_offset = -5;
+        tree[4].primitive_offset = 1;
+        if (scene::validate_flattened_bvh(tree, 5))
+        {
+            phatal_error("validate_flattened_bvh accepts a primitive in two leaves");
+        }
+
+        // A scene with all three kinds of leaves.
+        scene::init();
+        const int num_cubes = 5 * 5 * 4;
+        for (int i = 0; i < num_cubes; ++i)
+        {
+            const float x = (float)(i % 5);
+            const float y = (float)((i / 5) % 5);
+            const float z = (float)(i / 25);
+            scene::Cube cube = scene::make_cube(x, y, -z, 0.25f);
+            scene::submit_primitive(&cube);
+            scene::Sphere sphere = scene::make_sphere(x + 0.5f, y + 0.5f, -z - 0.5f, 0.2f);
+            scene::submit_primitive(&sphere);
+        }
+        glm::vec3 verts[6] = {
+            glm::vec3(-4, -1, -1), glm::vec3(-2, -1, -1), glm::vec3(-3, 1, -1),
+            glm::vec3(-4, -1, -3), glm::vec3(-2, -1, -3), glm::vec3(-3, 1, -3),
+        };
+        glm::vec3 norms[6];
+        for (int i = 0; i < 6; ++i)
+        {
+            norms[i] = glm::vec3(0, 0, 1);
+        }
+        scene::Chunk chunk;
+        chunk.verts = verts;
+        chunk.norms = norms;
+        chunk.num_verts = 6;
+        scene::submit_primitive(&chunk);
+        scene::update_structure();
+
+        int64 num_nodes = 0;
+        const BVHNode* flat = scene::get_flat_bvh(&num_nodes);
+        if (!flat || num_nodes < 2 * num_cubes + 1)
+        {
+            phatal_error("update_structure built no tree");
+        }
+        if (subtree_end(flat, 0) != num_nodes)
+        {
+            phatal_error("Flat BVH: the root's subtree is not the whole tree");
+        }
+        int64 num_leaves = 0;
+        int64 num_tris = 0;
+        for (int64 i = 0; i < num_nodes; ++i)
+        {
+            const BVHNode& node = flat[i];
+            if (node.primitive_offset < 0)
+            {
+                const int64 right_i = get_right_child(node);
+                // The left child is the next node, and its subtree ends where the right one starts.
+                if (subtree_end(flat, i + 1) != right_i)
+                {
+                    phatal_error("Flat BVH: right child does not follow the left subtree");
+                }
+                if (-node.primitive_offset != subtree_end(flat, i))
+                {
+                    printf("Node %ld: escape %d, subtree ends at %ld\n", (long)i,
+                            -node.primitive_offset, (long)subtree_end(flat, i));
+                    phatal_error("Flat BVH: escape offset is not where the subtree ends");
+                }
+                if (get_split_axis(node) > 2)
+                {
+                    phatal_error("Flat BVH: bad split axis");
+                }
+                continue;
+            }
+            ++num_leaves;
+            const int type = node.right_child_offset >> kPrimTypeShift;
+            if (type == PrimitiveType_Triangles)
+            {
+                num_tris += node.right_child_offset;
+            }
+            else if (node.primitive_offset != i)
+            {
+                phatal_error("Flat BVH: analytic leaf does not point at itself");
+            }
+        }
+        if (num_leaves != 2 * num_cubes + 1 || num_tris != 2)
+        {
+            phatal_error("Flat BVH: primitives missing from the leaves");
+        }
+        printf("Flat BVH escape offsets OK: %ld nodes.\n", (long)num_nodes);
+    }
+
+    // Test CPU packets against single rays ====================
+    // Packets of 4, 8 and 16 rays must render the cube grid exactly like rays
+    // traced one by one (packets of 1), with and without shadow rays.
+    {
+        const int width = 320;
+        const int height = 180;
+        vr::init(vr::Backend_SimulatedDK2);
+        cpu::init();
+        float K[11];
+        vr::fill_catmull_K(K, 11);
+        cpu::set_hmd(vr::get_hmd_constants(), K, 11, width, height);
+        cubes_scene();  // Uploads to the CPU tracer.
+
+        vr::FrameInfo frameinfo = {};
+        vr::RenderEyePose eye_pose = vr::begin_frame(&frameinfo);
+        vr::end_frame(&eye_pose, &frameinfo);
+        const vr::Eye eyes[2] = { frameinfo.left, frameinfo.right };
+
+        const size_t num_floats = (size_t)width * (size_t)height * 4;
+        float* reference = phalloc(float, num_floats);
+        float* image = phalloc(float, num_floats);
+        const int packet_sizes[] = { 4, 8, 16 };
+        for (int shadows = 0; shadows < 2; ++shadows)
+        {
+            cpu::RenderStats stats;
+            cpu::set_packet_size(1);
+            cpu::render(eyes, reference, &stats);
+            if (stats.primary_rays == 0 || (shadows && stats.shadow_rays == 0))
+            {
+                phatal_error("CPU tracer traced nothing");
+            }
+            for (int i = 0; i < 3; ++i)
+            {
+                cpu::set_packet_size(packet_sizes[i]);
+                cpu::render(eyes, image, &stats);
+                int64 num_differing = 0;
+                for (size_t p = 0; p < num_floats; p += 4)
+                {
+                    if (image[p + 0] != reference[p + 0] ||
+                        image[p + 1] != reference[p + 1] ||
+                        image[p + 2] != reference[p + 2] ||
+                        image[p + 3] != reference[p + 3])
+                    {
+                        ++num_differing;
+                    }
+                }
+                if (num_differing != 0)
+                {
+                    printf("Packets of %d, shadows %d: %ld pixels differ from single rays\n",
+                            packet_sizes[i], shadows, (long)num_differing);
+                    phatal_error("CPU packet traversal does not match single-ray traversal");
+                }
+            }
+            cpu::toggle_shadows();
+        }
+        phree(image);
+        phree(reference);
+        cpu::deinit();
+        vr::deinit();
+        printf("CPU packets match single rays.\n");
+    }
+
     ph::quit(EXIT_SUCCESS);
 }
 
@@ -13,12 +13,14 @@
 
 using namespace ph;
 
+#ifndef PH_HEADLESS
 static void bunny_idle()
 {
     ocl::draw();
 }
+#endif
 
-void bunny_sample()
+void bunny_scene()
 {
     scene::init();
 
@@ -63,6 +65,13 @@ void bunny_sample()
         phree(chunks[i].norms);
     }
     release(&chunks);
+}
+
+#ifndef PH_HEADLESS
+void bunny_sample()
+{
+    bunny_scene();
 
-    window::main_loop(bunny_idle);
+    window::main_loop(bunny_idle, sample_should_stop);
 }
+#endif
@@ -10,13 +10,15 @@
 
 using namespace ph;
 
+#ifndef PH_HEADLESS
 static void cubes_idle()
 {
     //vr::draw(g_resolution);  // defined in samples.cc
     ocl::draw();
 }
+#endif
 
-void cubes_sample()
+void cubes_scene()
 {
     scene::init();
 
@@ -38,7 +40,7 @@ void cubes_sample()
                 }
             }
         }
-        logf("INFO: Submitted %d polygons.\n", x * y * z * 12);
+        logf("INFO: Submitted %d cubes.\n", x * y * z);
     }
 
     io::set_wasd_camera(0,0,0);
@@ -46,6 +48,13 @@ void cubes_sample()
     scene::update_structure();
 
     scene::upload_everything();
+}
+
+#ifndef PH_HEADLESS
+void cubes_sample()
+{
+    cubes_scene();
 
-    window::main_loop(cubes_idle);
+    window::main_loop(cubes_idle, sample_should_stop);
 }
+#endif
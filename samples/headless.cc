@@ -0,0 +1,260 @@
+// Renders a sample scene to an image with the CPU tracer. At run time it opens
+// no window, HMD or GL context: for batch rendering and for timing the tracer
+// on machines without a display. The HMD is the simulated DK2 of vr.h.
+// It is built with PH_HEADLESS and links the headless library only (see the
+// top level CMakeLists.txt), so it needs none of the GLFW, GL, OpenCL or OVR
+// libraries.
+//
+//  headless [scene] [options]
+//
+//  scene                cubes (default), bunny, sponza, spheres or voxels
+//  -o <path>            PPM to write. Default: headless.ppm
+//  -size <w> <h>        Both eyes side by side. Default: 1280 720, the OpenCL render target.
+//  -pos <x> <y> <z>     Camera position. Default: the one the sample starts at.
+//  -yaw <deg>           Turn left.
+//  -pitch <deg>         Look up.
+//  -frames <n>          Render n times and report the average.
+//  -replay <path>       Render one frame per pose of a trace (see vr::load_pose_trace).
+//  -threads <n>         Default: one per core.
+//  -packet <n>          Primary rays per packet: 1, 4, 8 or 16.
+//  -shadows             Shadow rays to the light.
+
+#include <ph.h>
+
+#include "cpu_tracer.h"
+#include "io.h"
+#include "ocl.h"
+#include "scene.h"
+#include "vr.h"
+
+#include "samples.h"
+
+using namespace ph;
+
+typedef void (*SceneFunc)();
+
+struct HeadlessScene
+{
+    const char* name;
+    SceneFunc   build;
+};
+
+static HeadlessScene g_scenes[] =
+{
+    { "cubes",  cubes_scene },
+    { "bunny",  bunny_scene },
+    { "sponza", sponza_scene },
+    { "spheres", spheres_scene },
+    { "voxels", voxels_scene },
+};
+
+static const int kNumScenes = sizeof(g_scenes) / sizeof(HeadlessScene);
+
+// Turn the view of both eyes by yaw, then pitch, about `camera`.
+static void turn_eyes(const float* camera, float yaw, float pitch, vr::Eye* eyes)
+{
+    const float sy = sinf(yaw / 2);
+    const float cy = cosf(yaw / 2);
+    const float sp = sinf(pitch / 2);
+    const float cp = cosf(pitch / 2);
+    // Rotation about y times rotation about x.
+    const glm::quat turn(cy * cp, cy * sp, sy * cp, -sy * sp);
+    const glm::vec3 center(camera[0], camera[1], camera[2]);
+    for (int i = 0; i < vr::EYE_Count; ++i)
+    {
+        const float* o = eyes[i].orientation;
+        const glm::quat q = turn * glm::quat(o[3], o[0], o[1], o[2]);
+        const glm::vec3 p = center + turn * (glm::vec3(eyes[i].position[0], eyes[i].position[1],
+                    eyes[i].position[2]) - center);
+        eyes[i].orientation[0] = q.x;
+        eyes[i].orientation[1] = q.y;
+        eyes[i].orientation[2] = q.z;
+        eyes[i].orientation[3] = q.w;
+        eyes[i].position[0] = p.x;
+        eyes[i].position[1] = p.y;
+        eyes[i].position[2] = p.z;
+    }
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: headless [cubes|bunny|sponza|spheres|voxels] [-o path] [-size w h] "
+            "[-pos x y z] [-yaw deg] [-pitch deg] [-frames n] [-replay path] [-threads n] [-packet n] "
+            "[-shadows]\n");
+    ph::quit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv)
+{
+    ph::init();
+
+    const char* scene_name = "cubes";
+    const char* out_path = "headless.ppm";
+    int width = ocl::kRenderTargetWidth;
+    int height = ocl::kRenderTargetHeight;
+    bool has_position = false;
+    float position[3] = {};
+    float yaw = 0;
+    float pitch = 0;
+    int num_frames = 1;
+    const char* replay_path = NULL;
+    int num_threads = 0;
+    int packet_size = 0;
+    bool shadows = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        const int num_left = argc - i - 1;
+        if (!strcmp(arg, "-o") && num_left >= 1)
+        {
+            out_path = argv[++i];
+        }
+        else if (!strcmp(arg, "-size") && num_left >= 2)
+        {
+            width = atoi(argv[++i]);
+            height = atoi(argv[++i]);
+        }
+        else if (!strcmp(arg, "-pos") && num_left >= 3)
+        {
+            has_position = true;
+            for (int k = 0; k < 3; ++k)
+            {
+                position[k] = (float)atof(argv[++i]);
+            }
+        }
+        else if (!strcmp(arg, "-yaw") && num_left >= 1)
+        {
+            yaw = (float)atof(argv[++i]);
+        }
+        else if (!strcmp(arg, "-pitch") && num_left >= 1)
+        {
+            pitch = (float)atof(argv[++i]);
+        }
+        else if (!strcmp(arg, "-frames") && num_left >= 1)
+        {
+            num_frames = atoi(argv[++i]);
+        }
+        else if (!strcmp(arg, "-replay") && num_left >= 1)
+        {
+            replay_path = argv[++i];
+        }
+        else if (!strcmp(arg, "-threads") && num_left >= 1)
+        {
+            num_threads = atoi(argv[++i]);
+        }
+        else if (!strcmp(arg, "-packet") && num_left >= 1)
+        {
+            packet_size = atoi(argv[++i]);
+        }
+        else if (!strcmp(arg, "-shadows"))
+        {
+            shadows = true;
+        }
+        else if (arg[0] != '-')
+        {
+            scene_name = arg;
+        }
+        else
+        {
+            usage();
+        }
+    }
+    if (width < 2 || width % 2 != 0 || height < 1 || num_frames < 1 || num_threads < 0)
+    {
+        usage();
+    }
+    SceneFunc build_scene = NULL;
+    for (int i = 0; i < kNumScenes; ++i)
+    {
+        if (!strcmp(scene_name, g_scenes[i].name))
+        {
+            build_scene = g_scenes[i].build;
+        }
+    }
+    if (!build_scene)
+    {
+        usage();
+    }
+
+    // The simulated DK2: no device, and poses from the trace or standing still.
+    vr::init(vr::Backend_SimulatedDK2);
+    if (replay_path && !vr::load_pose_trace(replay_path))
+    {
+        fprintf(stderr, "ERROR: Could not load the pose trace %s\n", replay_path);
+        return EXIT_FAILURE;
+    }
+
+    cpu::init(num_threads);
+    {
+        float K[11];
+        vr::fill_catmull_K(K, 11);
+        cpu::set_hmd(vr::get_hmd_constants(), K, 11, width, height);
+    }
+    if (packet_size)
+    {
+        cpu::set_packet_size(packet_size);
+    }
+    if (shadows)
+    {
+        cpu::toggle_shadows();
+    }
+
+    scene::set_headless();
+    build_scene();
+
+    if (has_position)
+    {
+        io::set_wasd_camera(position[0], position[1], position[2]);
+    }
+    else
+    {
+        const float identity[4] = { 0, 0, 0, 1 };
+        io::get_wasd_camera(identity, position);
+    }
+    const float deg = 3.14159265f / 180;
+
+    float* image = phalloc(float, (size_t)width * (size_t)height * 4);
+    double total_ms = 0;
+    int64 primary_rays = 0;
+    int64 shadow_rays = 0;
+    int frame_i = 0;
+    for (;;)
+    {
+        if (replay_path ? vr::pose_trace_finished() : frame_i == num_frames)
+        {
+            break;
+        }
+        vr::FrameInfo frameinfo = {};
+        vr::RenderEyePose eye_pose = vr::begin_frame(&frameinfo);
+        vr::Eye eyes[2] = { frameinfo.left, frameinfo.right };
+        turn_eyes(position, yaw * deg, pitch * deg, eyes);
+        cpu::RenderStats stats;
+        cpu::render(eyes, image, &stats);
+        vr::end_frame(&eye_pose, &frameinfo);
+        total_ms += (double)stats.render_ms;
+        primary_rays += stats.primary_rays;
+        shadow_rays += stats.shadow_rays;
+        ++frame_i;
+    }
+    if (frame_i == 0)
+    {
+        fprintf(stderr, "ERROR: Nothing to render\n");
+        return EXIT_FAILURE;
+    }
+    printf("%s %dx%d: %.2f ms per frame over %d frames, %" PRId64 " primary + %" PRId64 " shadow rays, "
+            "%.2f Mrays/s\n", scene_name, width, height, total_ms / frame_i, frame_i,
+            primary_rays, shadow_rays, (double)(primary_rays + shadow_rays) / (total_ms * 1000));
+
+    // The last frame.
+    const bool written = cpu::write_ppm(out_path, image, width, height);
+    phree(image);
+    cpu::deinit();
+    vr::deinit();
+    if (!written)
+    {
+        fprintf(stderr, "ERROR: Could not write %s\n", out_path);
+        return EXIT_FAILURE;
+    }
+    printf("Wrote %s\n", out_path);
+    return 0;
+}
@@ -1,9 +1,12 @@
 #include "samples.h"
 #include "sample_list.h"
 
+#include "cpu_tracer.h"
 #include "io.h"
 #include "ocl.h"
 #include "ph.h"
+#include "profiler.h"
+#include "scene.h"
 #include "vr.h"
 #include "window.h"
 
@@ -17,9 +20,53 @@ int g_resolution[] = {1920, 1080};  // DK2 res
 static int        g_curr_sample = 1;
 static SampleFunc g_sample_func;
 
+// Trace the view of the last frame with the CPU tracer, save it next to the
+// executable and log how fast it went.
+static void cpu_reference_frame()
+{
+    // Same size as the OpenCL render target.
+    const int width = ocl::kRenderTargetWidth;
+    const int height = ocl::kRenderTargetHeight;
+    if (!cpu::is_initialized())
+    {
+        cpu::init();
+        float K[11];
+        vr::fill_catmull_K(K, 11);
+        cpu::set_hmd(vr::get_hmd_constants(), K, 11, width, height);
+        scene::upload_everything();
+    }
+    vr::Eye eyes[2];
+    ocl::get_last_eyes(eyes);
+    float* image = phalloc(float, width * height * 4);
+    cpu::RenderStats stats;
+    cpu::render(eyes, image, &stats);
+    cpu::write_ppm("cpu_frame.ppm", image, width, height);
+    phree(image);
+    logf("CPU frame: %.1f ms, %" PRId64 " primary + %" PRId64 " shadow rays, %.2f Mrays/s\n",
+            stats.render_ms, stats.primary_rays, stats.shadow_rays, stats.mrays_per_s);
+}
+
+bool sample_should_stop()
+{
+    return vr::pose_trace_finished();
+}
+
+static void log_frame_stats()
+{
+    const ocl::FrameStats stats = ocl::get_frame_stats();
+    logf("GPU frame (ms): acquire %.2f | trace %.2f | reconstruct %.2f | release %.2f\n"
+            "    device total %.2f | queue latency %.2f | host %.2f | rays %d\n",
+            stats.acquire_ms, stats.trace_ms, stats.reconstruct_ms, stats.release_ms,
+            stats.device_ms, stats.queue_ms, stats.host_ms, stats.rays_traced);
+}
+
 static void sample_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
     ph::io::wasd_callback(window, key, scancode, action, mods);
+    if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
+    {
+        glfwSetWindowShouldClose(window, GL_TRUE);
+    }
     if (key == GLFW_KEY_Q && action == GLFW_PRESS)
     {
         vr::toggle_postproc();
@@ -46,6 +93,43 @@ static void sample_callback(GLFWwindow* window, int key, int scancode, int actio
     {
         ocl::toggle_timewarp();
     }
+    if( key == GLFW_KEY_F && action == GLFW_PRESS )
+    {
+        ocl::toggle_foveation();
+    }
+    if( key == GLFW_KEY_R && action == GLFW_PRESS )
+    {
+        ocl::toggle_temporal();
+    }
+    if( key == GLFW_KEY_B && action == GLFW_PRESS )
+    {
+        ocl::toggle_stereo_traversal();
+    }
+    if( key == GLFW_KEY_V && action == GLFW_PRESS )
+    {
+        ocl::toggle_stereo_reuse();
+    }
+    if( key == GLFW_KEY_N && action == GLFW_PRESS )
+    {
+        ocl::toggle_stackless_traversal();
+    }
+    if( key == GLFW_KEY_H && action == GLFW_PRESS )
+    {
+        ocl::toggle_shadows();
+        cpu::toggle_shadows();
+    }
+    if( key == GLFW_KEY_G && action == GLFW_PRESS )
+    {
+        cpu_reference_frame();
+    }
+    if( key == GLFW_KEY_L && action == GLFW_PRESS )
+    {
+        log_frame_stats();
+    }
+    if( key == GLFW_KEY_T && action == GLFW_PRESS )
+    {
+        profiler::dump("profile.json");
+    }
     if( key == GLFW_KEY_J && action == GLFW_PRESS )
     {
         if (ocl::m_timewarp_factor >= 0.1f)
@@ -72,10 +156,51 @@ static void sample_callback(GLFWwindow* window, int key, int scancode, int actio
     }
 }
 
-int main()
+// Command line:
+//  -sample <n>         Start with sample n of sample_list.h
+//  -simulated          Simulated DK2 instead of a Rift, see vr::Backend.
+//  -replay <path>      Simulated DK2 replaying a pose trace. Quits when it ends.
+//  -record <path>      Record the pose of every frame to a trace.
+int main(int argc, char** argv)
 {
     ph_assert(g_num_samples >= 1);
     ph::init();
+
+    vr::Backend vr_backend = vr::Backend_Rift;
+    const char* replay_path = NULL;
+    const char* record_path = NULL;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-sample") && i + 1 < argc)
+        {
+            g_curr_sample = atoi(argv[++i]);
+            if (g_curr_sample < 0 || (size_t)g_curr_sample >= g_num_samples)
+            {
+                phatal_error("No sample with that number");
+            }
+        }
+        else if (!strcmp(argv[i], "-simulated"))
+        {
+            vr_backend = vr::Backend_SimulatedDK2;
+        }
+        else if (!strcmp(argv[i], "-replay") && i + 1 < argc)
+        {
+            vr_backend = vr::Backend_SimulatedDK2;
+            replay_path = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-record") && i + 1 < argc)
+        {
+            record_path = argv[++i];
+        }
+        else
+        {
+            fprintf(stderr, "Usage: samples [-sample n] [-simulated] [-replay path] [-record path]\n");
+            ph::quit(EXIT_FAILURE);
+        }
+    }
+#ifdef PH_PROFILE
+    profiler::dump_at_exit("profile.json");
+#endif
     // ====
     // OpenGL not supported for direct mode right now. Leaving this here
     // to keep order of func calls clear.
@@ -105,17 +230,27 @@ int main()
         phatal_error("Could not initialize OVR sensors!");
     }
 #endif
-    window::init("Samples", g_resolution[0], g_resolution[1],
-            window::InitFlag(
-                /* window::InitFlag_IgnoreRift | */
-                window::InitFlag_NoDecoration | window::InitFlag_OverrideKeyCallback));
+    int window_flags = window::InitFlag_NoDecoration | window::InitFlag_OverrideKeyCallback;
+    if (vr_backend != vr::Backend_Rift)
+    {
+        window_flags |= window::InitFlag_IgnoreRift;
+    }
+    window::init("Samples", g_resolution[0], g_resolution[1], window::InitFlag(window_flags));
 
 
     io::set_wasd_step(0.06f);
 
     glfwSetKeyCallback(ph::window::m_window, sample_callback);
 
-    vr::init();
+    vr::init(vr_backend);
+    if (replay_path && !vr::load_pose_trace(replay_path))
+    {
+        phatal_error("Could not load the pose trace");
+    }
+    if (record_path && !vr::start_pose_recording(record_path))
+    {
+        phatal_error("Could not open the pose trace for recording");
+    }
 
     g_sample_func = g_samples[g_curr_sample];
 
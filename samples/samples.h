@@ -1,3 +1,15 @@
 #pragma once
 
 extern int g_resolution[];
+
+// Stop condition for window::main_loop: a replayed pose trace ran out.
+bool sample_should_stop();
+
+// Build the scene of a sample and upload it, without running the sample.
+// The headless renderer (headless.cc) renders these. It compiles the sample
+// files with PH_HEADLESS, which leaves out the windowed *_sample() functions.
+void bunny_scene();
+void cubes_scene();
+void sponza_scene();
+void spheres_scene();
+void voxels_scene();
@@ -0,0 +1,58 @@
+#include <ph.h>
+#include <ocl.h>
+#include <scene.h>
+
+#include "samples.h"
+#include "window.h"
+
+using namespace ph;
+
+#ifndef PH_HEADLESS
+static void spheres_idle()
+{
+    ocl::draw();
+}
+#endif
+
+// A grid of spheres laid out like the cube grid, with radii that vary from
+// row to row. Spheres are intersected analytically, not as triangles.
+void spheres_scene()
+{
+    scene::init();
+
+    scene::Sphere ball;
+
+    {
+        int x = 20;
+        int y = 10;
+        int z = 50;
+        for (int i = 0; i < z; ++i)
+        {
+            for (int j = -4; j < y - 4; ++j)
+            {
+                for (int k = -x/2; k < x; ++k)
+                {
+                    float radius = 0.3f + 0.1f * (float)((i + j + k + 14) % 3);
+                    ball = scene::make_sphere(k * 1.1f, 4 + j * 1.1f, -5 - i*1.1f, radius);
+                    scene::submit_primitive(&ball);
+                }
+            }
+        }
+        logf("INFO: Submitted %d spheres.\n", (x + x/2) * y * z);
+    }
+
+    io::set_wasd_camera(0,0,0);
+
+    scene::update_structure();
+
+    scene::upload_everything();
+}
+
+#ifndef PH_HEADLESS
+void spheres_sample()
+{
+    spheres_scene();
+
+    window::main_loop(spheres_idle, sample_should_stop);
+}
+#endif
@@ -9,11 +9,13 @@
 
 using namespace ph;
 
+#ifndef PH_HEADLESS
 static void sponza_idle() {
     ocl::draw();
 }
+#endif
 
-void sponza_sample() {
+void sponza_scene() {
     scene::init();
 
     auto big_chunk = mesh::load_obj("third_party/ASSETS/sponza.obj", 0.02f);
@@ -24,13 +26,19 @@ void sponza_sample() {
         scene::submit_primitive(&small_chunks[i]);
     }
 
-    vr::disable_skybox();
-    vr::toggle_interlace_throttle();
-
     scene::update_structure();
     scene::upload_everything();
 
     logf("Small chunks: %lu\n", count(small_chunks));
+}
+
+#ifndef PH_HEADLESS
+void sponza_sample() {
+    sponza_scene();
+
+    vr::disable_skybox();
+    vr::toggle_interlace_throttle();
 
-    window::main_loop(sponza_idle);
+    window::main_loop(sponza_idle, sample_should_stop);
 }
+#endif
@@ -0,0 +1,58 @@
+#include <ph.h>
+#include <ocl.h>
+#include <scene.h>
+
+#include "samples.h"
+#include "window.h"
+
+using namespace ph;
+
+#ifndef PH_HEADLESS
+static void voxels_idle()
+{
+    ocl::draw();
+}
+#endif
+
+// Rolling hills of 512 x 512 columns, about 4.1 million voxels. No BVH is built:
+// the tracer walks the voxel grid directly.
+void voxels_scene()
+{
+    scene::init();
+
+    const int size_x = 512;
+    const int size_y = 64;
+    const int size_z = 512;
+    const float voxel_size = 0.1f;
+    scene::init_voxel_grid(glm::vec3(-size_x * voxel_size / 2, -5, -size_z * voxel_size - 1),
+            voxel_size, size_x, size_y, size_z);
+
+    int64 num_voxels = 0;
+    for (int z = 0; z < size_z; ++z)
+    {
+        for (int x = 0; x < size_x; ++x)
+        {
+            float h = 16 + 12 * sinf(x * 0.03f) * cosf(z * 0.05f) + 6 * sinf((x + z) * 0.11f);
+            int height = (int)h;
+            for (int y = 0; y < height && y < size_y; ++y)
+            {
+                scene::set_voxel(x, y, z);
+                ++num_voxels;
+            }
+        }
+    }
+    logf("INFO: Submitted %ld voxels.\n", (long)num_voxels);
+
+    io::set_wasd_camera(0,0,0);
+
+    scene::upload_everything();
+}
+
+#ifndef PH_HEADLESS
+void voxels_sample()
+{
+    voxels_scene();
+
+    window::main_loop(voxels_idle, sample_should_stop);
+}
+#endif
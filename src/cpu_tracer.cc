@@ -0,0 +1,1540 @@
+#include "cpu_tracer.h"
+
+#include "io.h"
+#include "ocl_interop_structs.h"
+#include "profiler.h"
+
+#include <emmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if !defined(_WIN32)
+#include <pthread.h>
+#endif
+
+// The tracing functions follow the ones of the same name in tracer.cl, and
+// give the same results. Keep them in sync.
+
+namespace ph
+{
+namespace cpu
+{
+
+struct Ray
+{
+    glm::vec3 o;
+    glm::vec3 d;
+};
+
+struct Intersection
+{
+    float       t;
+    glm::vec3   point;
+    glm::vec3   norm;
+    int         prim;   // Hit triangle, or -2 - the node of a hit analytic primitive. -1 on a miss.
+};
+
+// A ray with every component in all four SSE lanes, to test it against two
+// boxes or four triangles at once.
+struct WideRay
+{
+    __m128 o[3];
+    __m128 d[3];
+    __m128 inv_d[3];
+    __m128 neg_o_inv_d[3];  // -o * inv_d: a slab is then a multiply and an add.
+};
+
+// Threads pull tiles from next_tile until there are none left, like the
+// work groups of tracer.cl main.
+struct RenderJob
+{
+    const vr::Eye*  eyes;
+    float*          image;
+    int64           num_tiles;
+    volatile int64  next_tile;
+    volatile int64  primary_rays;
+    volatile int64  shadow_rays;
+};
+
+// Tiles are square and within one eye.
+static const int kTileSize = 16;
+static const int kMaxThreads = 64;
+// Deepest tree trace() can walk with a stack. Deeper ones go through the escape offsets.
+static const int kStackSize = 64;
+static const int kMaxCoefficients = 16;
+// Keep in sync with kLensRadiusSq in ocl.cc
+static const float kLensRadiusSq = 0.25f;
+
+static bool             m_initialized = false;
+static int              m_num_threads;
+static bool             m_shadows = false;
+static CLwoopTriangle*  m_tris = NULL;          // In leaf order, see BVHNode.
+static CLpackedNormals* m_norms = NULL;
+static BVHNode*         m_nodes = NULL;
+static int64            m_num_nodes = 0;
+static bool             m_stackless = false;    // The tree is deeper than kStackSize.
+static bool             m_voxel_grid = false;   // Trace the grid instead of the BVH.
+static CLvoxelGrid      m_grid;
+static int*             m_grid_cells = NULL;
+static uint32_t*        m_bricks = NULL;
+static glm::vec4*       m_ray_table = NULL;     // See tracer.cl ray_table. Both eyes.
+static int              m_width;                // Both eyes.
+static int              m_height;
+static int              m_packet_w = 4;         // Pixels per primary ray packet. 1 * 1 traces rays alone.
+static int              m_packet_h = 4;
+
+// Never hit: t = -1 / 0. Lanes past the last triangle of a leaf test this one.
+static const CLwoopTriangle k_no_triangle =
+{
+    {
+        { 0, 0, 0, 0 },
+        { 0, 0, 0, 0 },
+        { 0, 0, 0, 1 },
+    },
+    { 0, 0, 0, 0 },
+};
+
+static int64 fetch_add(volatile int64* dst, int64 val)
+{
+#if defined(_MSC_VER)
+    return _InterlockedExchangeAdd64((volatile long long*)dst, val);
+#else
+    return __atomic_fetch_add(dst, val, __ATOMIC_ACQ_REL);
+#endif
+}
+
+static int get_num_cores()
+{
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    return (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+}
+
+////////////////////////////////////////
+// Tracing
+////////////////////////////////////////
+
+static glm::vec3 rotate_vector_quat(const glm::vec3 vec, const float* quat)
+{
+    const glm::vec3 i = -glm::vec3(quat[0], quat[1], quat[2]);
+    const float m = quat[3];
+    return vec + 2.0f * glm::cross(m * vec + glm::cross(vec, i), i);
+}
+
+static glm::vec3 inverse_dir(const glm::vec3 d)
+{
+    glm::vec3 inv;
+    for (int k = 0; k < 3; ++k)
+    {
+        inv[k] = 1 / copysignf(fmaxf(fabsf(d[k]), 1e-20f), d[k]);
+    }
+    return inv;
+}
+
+static WideRay make_wide_ray(const Ray& ray, const glm::vec3 inv_dir)
+{
+    WideRay r;
+    for (int k = 0; k < 3; ++k)
+    {
+        r.o[k] = _mm_set1_ps(ray.o[k]);
+        r.d[k] = _mm_set1_ps(ray.d[k]);
+        r.inv_d[k] = _mm_set1_ps(inv_dir[k]);
+        r.neg_o_inv_d[k] = _mm_set1_ps(-(ray.o[k] * inv_dir[k]));
+    }
+    return r;
+}
+
+static float bbox_collision(const AABB& box, const Ray& ray, const glm::vec3 inv_dir, float* far_t)
+{
+    const glm::vec3 m = -(ray.o * inv_dir);
+    float rmin = box.xmin * inv_dir.x + m.x;
+    float rmax = box.xmax * inv_dir.x + m.x;
+    float t0 = fminf(rmin, rmax);
+    *far_t = fmaxf(rmin, rmax);
+
+    rmin = box.ymin * inv_dir.y + m.y;
+    rmax = box.ymax * inv_dir.y + m.y;
+    t0 = fmaxf(t0, fminf(rmin, rmax));
+    *far_t = fminf(*far_t, fmaxf(rmin, rmax));
+
+    rmin = box.zmin * inv_dir.z + m.z;
+    rmax = box.zmax * inv_dir.z + m.z;
+    t0 = fmaxf(t0, fminf(rmin, rmax));
+    *far_t = fminf(*far_t, fmaxf(rmin, rmax));
+    return t0;
+}
+
+// bbox_collision() with `a` and `b` at once: lanes 0 and 1 of the results are
+// a's near and far t, lanes 2 and 3 b's.
+static void bbox_collision_pair(const AABB& a, const AABB& b, const WideRay& r, __m128* near_t, __m128* far_t)
+{
+    const __m128 a_xy = _mm_loadu_ps(&a.xmin);
+    const __m128 b_xy = _mm_loadu_ps(&b.xmin);
+    const __m128 slabs[3] =
+    {
+        _mm_movelh_ps(a_xy, b_xy),      // a.xmin a.xmax b.xmin b.xmax
+        _mm_movehl_ps(b_xy, a_xy),      // a.ymin a.ymax b.ymin b.ymax
+        _mm_set_ps(b.zmax, b.zmin, a.zmax, a.zmin),
+    };
+    for (int k = 0; k < 3; ++k)
+    {
+        const __m128 t = _mm_add_ps(_mm_mul_ps(slabs[k], r.inv_d[k]), r.neg_o_inv_d[k]);
+        const __m128 swapped = _mm_shuffle_ps(t, t, _MM_SHUFFLE(2, 3, 0, 1));
+        const __m128 t0 = _mm_min_ps(t, swapped);
+        const __m128 t1 = _mm_max_ps(t, swapped);
+        *near_t = (k == 0) ? t0 : _mm_max_ps(*near_t, t0);
+        *far_t = (k == 0) ? t1 : _mm_min_ps(*far_t, t1);
+    }
+}
+
+// Bit 0 set if the ray meets box a before max_t, bit 2 for box b.
+static int pair_hits(const __m128 near_t, const __m128 far_t, const float max_t)
+{
+    const __m128 hit = _mm_and_ps(
+            _mm_and_ps(_mm_cmplt_ps(near_t, far_t), _mm_cmplt_ps(near_t, _mm_set1_ps(max_t))),
+            _mm_cmpgt_ps(far_t, _mm_setzero_ps()));
+    return _mm_movemask_ps(hit);
+}
+
+// dot(row.xyz, v) + row.w, one triangle per lane.
+static __m128 transform4(const __m128* row, const __m128* v)
+{
+    return _mm_add_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(row[0], v[0]), _mm_mul_ps(row[1], v[1])), _mm_mul_ps(row[2], v[2])),
+            row[3]);
+}
+
+// tracer.cl barycentric() for triangles [first, first + min(num_tris, 4)).
+// Writes (t, u, v) of every triangle and returns a mask of the ones hit at t > 0.
+static int barycentric4(const int first, const int num_tris, const WideRay& r, float* t, float* u, float* v)
+{
+    __m128 rows[3][4];  // rows[k][c]: component c of row k of every triangle.
+    for (int k = 0; k < 3; ++k)
+    {
+        for (int j = 0; j < 4; ++j)
+        {
+            const CLwoopTriangle* tri = (j < num_tris) ? &m_tris[first + j] : &k_no_triangle;
+            rows[k][j] = _mm_loadu_ps(tri->rows[k]);
+        }
+        _MM_TRANSPOSE4_PS(rows[k][0], rows[k][1], rows[k][2], rows[k][3]);
+    }
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1);
+    const __m128 oz = transform4(rows[2], r.o);
+    const __m128 dz = _mm_add_ps(_mm_add_ps(
+                _mm_mul_ps(rows[2][0], r.d[0]), _mm_mul_ps(rows[2][1], r.d[1])), _mm_mul_ps(rows[2][2], r.d[2]));
+    const __m128 t4 = _mm_div_ps(_mm_sub_ps(zero, oz), dz);
+    __m128 p[3];
+    for (int k = 0; k < 3; ++k)
+    {
+        p[k] = _mm_add_ps(r.o[k], _mm_mul_ps(t4, r.d[k]));
+    }
+    const __m128 u4 = transform4(rows[0], p);
+    const __m128 v4 = transform4(rows[1], p);
+    _mm_storeu_ps(t, t4);
+    _mm_storeu_ps(u, u4);
+    _mm_storeu_ps(v, v4);
+    __m128 hit = _mm_and_ps(_mm_cmpgt_ps(t4, zero), _mm_cmplt_ps(_mm_add_ps(u4, v4), one));
+    hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(u4, zero), _mm_cmplt_ps(u4, one)));
+    hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(v4, zero), _mm_cmplt_ps(v4, one)));
+    return _mm_movemask_ps(hit);
+}
+
+static float ray_sphere(const Ray& ray, const glm::vec3 c, const float r)
+{
+    const glm::vec3 oc = ray.o - c;
+    const float b = glm::dot(ray.d, oc);
+    const float d = glm::dot(oc, oc) - r * r;
+    const float det = b*b - d;
+    if (det < 0)
+    {
+        return -1;
+    }
+    const float s = sqrtf(det);
+    return (-b - s > 0) ? -b - s : -b + s;
+}
+
+static int primitive_type(const BVHNode& node)
+{
+    return node.right_child_offset >> kPrimTypeShift;
+}
+
+static void intersect_triangles(
+        const int first_tri,
+        const int num_tris,
+        const Ray& ray,
+        const WideRay& r,
+        float* min_t,
+        Intersection* its)
+{
+    for (int j = 0; j < num_tris; j += 4)
+    {
+        float t[4], u[4], v[4];
+        int hits = barycentric4(first_tri + j, num_tris - j, r, t, u, v);
+        // In order, so the first of equally near triangles wins as in tracer.cl
+        for (int lane = 0; hits != 0; ++lane, hits >>= 1)
+        {
+            if ((hits & 1) && t[lane] < *min_t)
+            {
+                const int offset = first_tri + j + lane;
+                *min_t = t[lane];
+                const CLpackedNormals& norm = m_norms[offset];
+                its->norm = (1 - u[lane] - v[lane]) * decode_normal(norm.n[0]) +
+                    u[lane] * decode_normal(norm.n[1]) + v[lane] * decode_normal(norm.n[2]);
+                its->point = ray.o + t[lane] * ray.d;
+                its->t = t[lane];
+                its->prim = offset;
+            }
+        }
+    }
+}
+
+static void intersect_box(
+        const BVHNode& leaf,
+        const Ray& ray,
+        const glm::vec3 inv_dir,
+        float* min_t,
+        Intersection* its)
+{
+    float far_t;
+    const float near_t = bbox_collision(leaf.bbox, ray, inv_dir, &far_t);
+    const float t = (near_t > 0) ? near_t : far_t;
+    if (near_t < far_t && t > 0 && t < *min_t)
+    {
+        *min_t = t;
+        const AABB& b = leaf.bbox;
+        its->point = ray.o + t * ray.d;
+        const glm::vec3 half = 0.5f * glm::vec3(b.xmax - b.xmin, b.ymax - b.ymin, b.zmax - b.zmin);
+        const glm::vec3 q = (its->point - glm::vec3(b.xmin, b.ymin, b.zmin) - half) / half;
+        const glm::vec3 a = glm::abs(q);
+        glm::vec3 n(0, 0, 1);
+        if (a.x > a.y && a.x > a.z)
+        {
+            n = glm::vec3(1, 0, 0);
+        }
+        else if (a.y > a.z)
+        {
+            n = glm::vec3(0, 1, 0);
+        }
+        its->norm = (glm::dot(n, ray.d) < 0) ? n : -n;
+        its->t = t;
+        its->prim = -2 - leaf.primitive_offset;
+    }
+}
+
+static void intersect_sphere(
+        const BVHNode& leaf,
+        const Ray& ray,
+        float* min_t,
+        Intersection* its)
+{
+    const AABB& b = leaf.bbox;
+    const glm::vec3 c = 0.5f * glm::vec3(b.xmin + b.xmax, b.ymin + b.ymax, b.zmin + b.zmax);
+    const float r = 0.5f * (b.xmax - b.xmin);
+    const float t = ray_sphere(ray, c, r);
+    if (t > 0 && t < *min_t)
+    {
+        *min_t = t;
+        its->point = ray.o + t * ray.d;
+        const glm::vec3 n = (its->point - c) / r;
+        its->norm = (glm::dot(n, ray.d) < 0) ? n : -n;
+        its->t = t;
+        its->prim = -2 - leaf.primitive_offset;
+    }
+}
+
+static void intersect_leaf(
+        const BVHNode& leaf,
+        const Ray& ray,
+        const glm::vec3 inv_dir,
+        const WideRay& r,
+        float* min_t,
+        Intersection* its)
+{
+    const int type = primitive_type(leaf);
+    if (type == PrimitiveType_Box)
+    {
+        intersect_box(leaf, ray, inv_dir, min_t, its);
+    }
+    else if (type == PrimitiveType_Sphere)
+    {
+        intersect_sphere(leaf, ray, min_t, its);
+    }
+    else
+    {
+        intersect_triangles(leaf.primitive_offset, leaf.right_child_offset, ray, r, min_t, its);
+    }
+}
+
+// See BVHNode.
+static int escape_offset(const BVHNode& node, const int node_i)
+{
+    return (node.primitive_offset < 0) ? -node.primitive_offset : node_i + 1;
+}
+
+// trace() without a stack, as tracer.cl trace_stackless(): nodes are visited in
+// depth first order, and a missed subtree is skipped through its escape offset.
+// Children are always visited left first.
+static Intersection trace_stackless(const Ray& ray)
+{
+    Intersection its;
+    its.t = 0;
+    its.prim = -1;
+    const glm::vec3 inv_dir = inverse_dir(ray.d);
+    const WideRay r = make_wide_ray(ray, inv_dir);
+    float min_t = 1 << 16;
+    int node_i = 0;
+    while (node_i < m_num_nodes)
+    {
+        const BVHNode& node = m_nodes[node_i];
+        float far_t;
+        const float near_t = bbox_collision(node.bbox, ray, inv_dir, &far_t);
+        if (near_t < far_t && near_t < min_t && far_t > 0)
+        {
+            if (node.primitive_offset >= 0)
+            {
+                intersect_leaf(node, ray, inv_dir, r, &min_t, &its);
+            }
+            // Left child, or the next node after a leaf.
+            node_i = node_i + 1;
+        }
+        else
+        {
+            node_i = escape_offset(node, node_i);
+        }
+    }
+    return its;
+}
+
+// Closest hit, from the root. Both children of a node are tested at once; when
+// both are hit, the one on the side the ray comes from along the split axis is
+// visited first.
+static Intersection trace(const Ray& ray)
+{
+    Intersection its;
+    its.t = 0;
+    its.prim = -1;
+    if (m_num_nodes == 0)
+    {
+        return its;
+    }
+    if (m_stackless)
+    {
+        return trace_stackless(ray);
+    }
+    const glm::vec3 inv_dir = inverse_dir(ray.d);
+    const WideRay r = make_wide_ray(ray, inv_dir);
+    const int dir_neg = (ray.d.x < 0) | ((ray.d.y < 0) << 1) | ((ray.d.z < 0) << 2);
+
+    int stack[kStackSize];
+    int stack_offset = 0;
+    int node_i = 0;
+    float min_t = 1 << 16;
+    while (true)
+    {
+        const BVHNode& node = m_nodes[node_i];
+        if (node.primitive_offset < 0)
+        {
+            const int left_i = node_i + 1;
+            const int right_i = get_right_child(node);
+            __m128 near_t, far_t;
+            bbox_collision_pair(m_nodes[left_i].bbox, m_nodes[right_i].bbox, r, &near_t, &far_t);
+            const int hits = pair_hits(near_t, far_t, min_t);
+            const bool hit_l = (hits & 1) != 0;
+            const bool hit_r = (hits & 4) != 0;
+            if (hit_l && hit_r)
+            {
+                const bool right_first = ((dir_neg >> get_split_axis(node)) & 1) != 0;
+                stack[stack_offset++] = right_first ? left_i : right_i;
+                node_i = right_first ? right_i : left_i;
+                continue;
+            }
+            if (hit_l || hit_r)
+            {
+                node_i = hit_l ? left_i : right_i;
+                continue;
+            }
+        }
+        else
+        {
+            intersect_leaf(node, ray, inv_dir, r, &min_t, &its);
+        }
+        if (stack_offset == 0)
+        {
+            return its;
+        }
+        node_i = stack[--stack_offset];
+    }
+}
+
+static bool hits_leaf(const BVHNode& leaf, const Ray& ray, const WideRay& r,
+        const float near_t, const float far_t, const float max_t)
+{
+    const int type = primitive_type(leaf);
+    if (type == PrimitiveType_Box)
+    {  // The bbox is the box. From inside, the ray hits where it leaves.
+        return near_t > 0 || far_t < max_t;
+    }
+    else if (type == PrimitiveType_Sphere)
+    {
+        const AABB& b = leaf.bbox;
+        const glm::vec3 c = 0.5f * glm::vec3(b.xmin + b.xmax, b.ymin + b.ymax, b.zmin + b.zmax);
+        const float t = ray_sphere(ray, c, 0.5f * (b.xmax - b.xmin));
+        return t > 0 && t < max_t;
+    }
+    for (int j = 0; j < leaf.right_child_offset; j += 4)
+    {
+        float t[4], u[4], v[4];
+        const int hits = barycentric4(leaf.primitive_offset + j, leaf.right_child_offset - j, r, t, u, v);
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            if ((hits & (1 << lane)) && t[lane] < max_t)
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// occluded() through the escape offsets, see trace_stackless().
+static bool occluded_stackless(const Ray& ray, const glm::vec3 inv_dir, const WideRay& r, const float max_t)
+{
+    int node_i = 0;
+    while (node_i < m_num_nodes)
+    {
+        const BVHNode& node = m_nodes[node_i];
+        float far_t;
+        const float near_t = bbox_collision(node.bbox, ray, inv_dir, &far_t);
+        if (near_t < far_t && near_t < max_t && far_t > 0)
+        {
+            if (node.primitive_offset >= 0 && hits_leaf(node, ray, r, near_t, far_t, max_t))
+            {
+                return true;
+            }
+            node_i = node_i + 1;
+        }
+        else
+        {
+            node_i = escape_offset(node, node_i);
+        }
+    }
+    return false;
+}
+
+// Any hit along `ray` before max_t, for shadow rays.
+static bool occluded(const Ray& ray, const float max_t)
+{
+    if (m_num_nodes == 0)
+    {
+        return false;
+    }
+    const glm::vec3 inv_dir = inverse_dir(ray.d);
+    const WideRay r = make_wide_ray(ray, inv_dir);
+    if (m_stackless)
+    {
+        return occluded_stackless(ray, inv_dir, r, max_t);
+    }
+    int stack[kStackSize];
+    int stack_offset = 0;
+    int node_i = 0;
+    while (true)
+    {
+        const BVHNode& node = m_nodes[node_i];
+        if (node.primitive_offset < 0)
+        {
+            const int left_i = node_i + 1;
+            const int right_i = get_right_child(node);
+            __m128 near_t, far_t;
+            bbox_collision_pair(m_nodes[left_i].bbox, m_nodes[right_i].bbox, r, &near_t, &far_t);
+            const int hits = pair_hits(near_t, far_t, max_t);
+            if ((hits & 1) && (hits & 4))
+            {
+                stack[stack_offset++] = right_i;
+            }
+            if (hits & 5)
+            {
+                node_i = (hits & 1) ? left_i : right_i;
+                continue;
+            }
+        }
+        else
+        {
+            float far_t;
+            const float near_t = bbox_collision(node.bbox, ray, inv_dir, &far_t);
+            if (near_t < far_t && near_t < max_t && far_t > 0 &&
+                    hits_leaf(node, ray, r, near_t, far_t, max_t))
+            {
+                return true;
+            }
+        }
+        if (stack_offset == 0)
+        {
+            return false;
+        }
+        node_i = stack[--stack_offset];
+    }
+}
+
+// ==== Ray packets
+// Primary rays of neighbouring pixels visit nearly the same nodes, so blocks of
+// 2x2, 4x2 or 4x4 pixels walk the tree together: every node is fetched once for
+// the whole packet. Rays are in groups of four, one per SSE lane; ray i is
+// lane i % 4 of group i / 4. A mask of the rays that still need a subtree
+// goes down with it, and rays that miss a node drop out of its subtree.
+//
+// Before testing its rays one by one against a box, the packet is culled as a
+// whole with interval arithmetic: when all its rays go the same way along
+// every axis, bounds of their origins and inverse directions bound the slab
+// distances of every ray (Boulos et al. 2006, "Geometric and arithmetic
+// culling methods for entire ray packets").
+//
+// Every ray visits the nodes it hits in the order trace() would visit them,
+// so the hits are the ones trace() finds for each ray alone, down to which of
+// two equally near primitives is reported.
+
+static const int kMaxPacketRays = 16;
+static const int kMaxPacketGroups = kMaxPacketRays / 4;
+
+struct Packet
+{
+    int         num_groups;
+    WideRay     groups[kMaxPacketGroups];
+    Ray         rays[kMaxPacketRays];
+    glm::vec3   inv_dirs[kMaxPacketRays];
+    float       min_t[kMaxPacketRays];
+    bool        coherent;       // All rays have the direction signs of dir_neg.
+    int         dir_neg;        // As in trace(). Of the first ray, if not coherent.
+    int         neg_rays[3];    // Per axis, the rays that go down it.
+    // Bounds over the packet for interval culling, x y z in lanes 0 to 2.
+    __m128      o_lo;
+    __m128      o_hi;
+    __m128      inv_lo;
+    __m128      inv_hi;
+    __m128      neg_mask;       // Lanes of the axes the rays go down.
+};
+
+// Rays in `active` are traced. The others only fill lanes and can be anything finite.
+static void make_packet(Packet* p, const Ray* rays, const int num_rays, const int active)
+{
+    p->num_groups = (num_rays + 3) / 4;
+    p->coherent = true;
+    p->dir_neg = -1;
+    p->neg_rays[0] = p->neg_rays[1] = p->neg_rays[2] = 0;
+    float o_lo[4] = { FLT_MAX, FLT_MAX, FLT_MAX, 0 };
+    float o_hi[4] = { -FLT_MAX, -FLT_MAX, -FLT_MAX, 0 };
+    float inv_lo[4] = { FLT_MAX, FLT_MAX, FLT_MAX, 0 };
+    float inv_hi[4] = { -FLT_MAX, -FLT_MAX, -FLT_MAX, 0 };
+    float lanes[4][3][kMaxPacketRays];  // o, d, inv_d
+    for (int i = 0; i < 4 * p->num_groups; ++i)
+    {
+        const Ray& ray = rays[(i < num_rays) ? i : 0];
+        const glm::vec3 inv_dir = inverse_dir(ray.d);
+        p->rays[i] = ray;
+        p->inv_dirs[i] = inv_dir;
+        p->min_t[i] = 1 << 16;
+        for (int k = 0; k < 3; ++k)
+        {
+            lanes[0][k][i] = ray.o[k];
+            lanes[1][k][i] = ray.d[k];
+            lanes[2][k][i] = inv_dir[k];
+            lanes[3][k][i] = -(ray.o[k] * inv_dir[k]);
+        }
+        if (i < num_rays && (active & (1 << i)))
+        {
+            const int dir_neg = (ray.d.x < 0) | ((ray.d.y < 0) << 1) | ((ray.d.z < 0) << 2);
+            if (p->dir_neg < 0)
+            {
+                p->dir_neg = dir_neg;
+            }
+            p->coherent = p->coherent && dir_neg == p->dir_neg;
+            for (int k = 0; k < 3; ++k)
+            {
+                p->neg_rays[k] |= ((dir_neg >> k) & 1) << i;
+                o_lo[k] = fminf(o_lo[k], ray.o[k]);
+                o_hi[k] = fmaxf(o_hi[k], ray.o[k]);
+                inv_lo[k] = fminf(inv_lo[k], inv_dir[k]);
+                inv_hi[k] = fmaxf(inv_hi[k], inv_dir[k]);
+            }
+        }
+    }
+    p->o_lo = _mm_loadu_ps(o_lo);
+    p->o_hi = _mm_loadu_ps(o_hi);
+    p->inv_lo = _mm_loadu_ps(inv_lo);
+    p->inv_hi = _mm_loadu_ps(inv_hi);
+    p->neg_mask = _mm_cmplt_ps(p->inv_hi, _mm_setzero_ps());
+    for (int g = 0; g < p->num_groups; ++g)
+    {
+        for (int k = 0; k < 3; ++k)
+        {
+            p->groups[g].o[k] = _mm_loadu_ps(&lanes[0][k][4 * g]);
+            p->groups[g].d[k] = _mm_loadu_ps(&lanes[1][k][4 * g]);
+            p->groups[g].inv_d[k] = _mm_loadu_ps(&lanes[2][k][4 * g]);
+            p->groups[g].neg_o_inv_d[k] = _mm_loadu_ps(&lanes[3][k][4 * g]);
+        }
+    }
+}
+
+// Smallest and largest of (plane - o) * inv over the packet's bounds of o and
+// inv, for each axis.
+static void interval_slab(const Packet& p, const __m128 plane, __m128* lo, __m128* hi)
+{
+    const __m128 a_lo = _mm_sub_ps(plane, p.o_hi);
+    const __m128 a_hi = _mm_sub_ps(plane, p.o_lo);
+    const __m128 p0 = _mm_mul_ps(a_lo, p.inv_lo);
+    const __m128 p1 = _mm_mul_ps(a_lo, p.inv_hi);
+    const __m128 p2 = _mm_mul_ps(a_hi, p.inv_lo);
+    const __m128 p3 = _mm_mul_ps(a_hi, p.inv_hi);
+    *lo = _mm_min_ps(_mm_min_ps(p0, p1), _mm_min_ps(p2, p3));
+    *hi = _mm_max_ps(_mm_max_ps(p0, p1), _mm_max_ps(p2, p3));
+}
+
+// True if no ray of a coherent packet meets `box` before max_t.
+static bool packet_misses_box(const Packet& p, const AABB& box, const float max_t)
+{
+    const __m128 box_min = _mm_set_ps(0, box.zmin, box.ymin, box.xmin);
+    const __m128 box_max = _mm_set_ps(0, box.zmax, box.ymax, box.xmax);
+    const __m128 near_plane = _mm_or_ps(_mm_and_ps(p.neg_mask, box_max), _mm_andnot_ps(p.neg_mask, box_min));
+    const __m128 far_plane = _mm_or_ps(_mm_and_ps(p.neg_mask, box_min), _mm_andnot_ps(p.neg_mask, box_max));
+    __m128 near_lo, far_hi, unused;
+    interval_slab(p, near_plane, &near_lo, &unused);
+    interval_slab(p, far_plane, &unused, &far_hi);
+    // No ray enters the box before the latest near_lo, nor leaves it after the earliest far_hi.
+    float near_t[4], far_t[4];
+    _mm_storeu_ps(near_t, near_lo);
+    _mm_storeu_ps(far_t, far_hi);
+    const float t0 = fmaxf(fmaxf(near_t[0], near_t[1]), near_t[2]);
+    const float t1 = fminf(fminf(fminf(far_t[0], far_t[1]), far_t[2]), max_t);
+    // The rays compute their distances in another order. Leave room for the rounding.
+    const float slack = 1e-5f * (fabsf(t0) + fabsf(t1));
+    return t0 - slack >= t1 + slack || t1 + slack <= 0;
+}
+
+// Rays of `mask` that meet `box` before their closest hit so far.
+static int packet_hits_box(const Packet& p, const AABB& box, const int mask, const float max_t)
+{
+    if (p.coherent && packet_misses_box(p, box, max_t))
+    {
+        return 0;
+    }
+    const float* bounds = &box.xmin;
+    int hits = 0;
+    for (int g = 0; g < p.num_groups; ++g)
+    {
+        if (((mask >> (4 * g)) & 0xf) == 0)
+        {
+            continue;
+        }
+        const WideRay& r = p.groups[g];
+        __m128 near_t = _mm_setzero_ps();
+        __m128 far_t = _mm_setzero_ps();
+        for (int k = 0; k < 3; ++k)
+        {
+            const __m128 t0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(bounds[2 * k]), r.inv_d[k]), r.neg_o_inv_d[k]);
+            const __m128 t1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(bounds[2 * k + 1]), r.inv_d[k]), r.neg_o_inv_d[k]);
+            near_t = (k == 0) ? _mm_min_ps(t0, t1) : _mm_max_ps(near_t, _mm_min_ps(t0, t1));
+            far_t = (k == 0) ? _mm_max_ps(t0, t1) : _mm_min_ps(far_t, _mm_max_ps(t0, t1));
+        }
+        const __m128 hit = _mm_and_ps(
+                _mm_and_ps(_mm_cmplt_ps(near_t, far_t), _mm_cmplt_ps(near_t, _mm_loadu_ps(&p.min_t[4 * g]))),
+                _mm_cmpgt_ps(far_t, _mm_setzero_ps()));
+        hits |= _mm_movemask_ps(hit) << (4 * g);
+    }
+    return hits & mask;
+}
+
+// Triangle hits only keep t, the triangle and (u, v) here; trace_packet()
+// fills in the point and normal at the end.
+static void intersect_triangles_packet(
+        Packet* p,
+        const int first_tri,
+        const int num_tris,
+        const int mask,
+        float* hit_u,
+        float* hit_v,
+        Intersection* its)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1);
+    for (int j = 0; j < num_tris; ++j)
+    {
+        const CLwoopTriangle& tri = m_tris[first_tri + j];
+        __m128 rows[3][4];
+        for (int k = 0; k < 3; ++k)
+        {
+            for (int c = 0; c < 4; ++c)
+            {
+                rows[k][c] = _mm_set1_ps(tri.rows[k][c]);
+            }
+        }
+        for (int g = 0; g < p->num_groups; ++g)
+        {
+            const int group_mask = (mask >> (4 * g)) & 0xf;
+            if (group_mask == 0)
+            {
+                continue;
+            }
+            const WideRay& r = p->groups[g];
+            const __m128 oz = transform4(rows[2], r.o);
+            const __m128 dz = _mm_add_ps(_mm_add_ps(
+                        _mm_mul_ps(rows[2][0], r.d[0]), _mm_mul_ps(rows[2][1], r.d[1])), _mm_mul_ps(rows[2][2], r.d[2]));
+            const __m128 t = _mm_div_ps(_mm_sub_ps(zero, oz), dz);
+            __m128 point[3];
+            for (int k = 0; k < 3; ++k)
+            {
+                point[k] = _mm_add_ps(r.o[k], _mm_mul_ps(t, r.d[k]));
+            }
+            const __m128 u = transform4(rows[0], point);
+            const __m128 v = transform4(rows[1], point);
+            const __m128 min_t = _mm_loadu_ps(&p->min_t[4 * g]);
+            __m128 hit = _mm_and_ps(_mm_cmpgt_ps(t, zero), _mm_cmplt_ps(t, min_t));
+            hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(u, zero), _mm_cmplt_ps(u, one)));
+            hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(v, zero), _mm_cmplt_ps(v, one)));
+            hit = _mm_and_ps(hit, _mm_cmplt_ps(_mm_add_ps(u, v), one));
+            const int hits = _mm_movemask_ps(hit) & group_mask;
+            if (hits == 0)
+            {
+                continue;
+            }
+            float t_lanes[4], u_lanes[4], v_lanes[4];
+            _mm_storeu_ps(t_lanes, t);
+            _mm_storeu_ps(u_lanes, u);
+            _mm_storeu_ps(v_lanes, v);
+            for (int lane = 0; lane < 4; ++lane)
+            {
+                if (hits & (1 << lane))
+                {
+                    const int i = 4 * g + lane;
+                    p->min_t[i] = t_lanes[lane];
+                    hit_u[i] = u_lanes[lane];
+                    hit_v[i] = v_lanes[lane];
+                    its[i].t = t_lanes[lane];
+                    its[i].prim = first_tri + j;
+                }
+            }
+        }
+    }
+}
+
+static void intersect_leaf_packet(
+        Packet* p,
+        const BVHNode& leaf,
+        const int mask,
+        float* hit_u,
+        float* hit_v,
+        Intersection* its)
+{
+    const int type = primitive_type(leaf);
+    if (type == PrimitiveType_Triangles)
+    {
+        intersect_triangles_packet(p, leaf.primitive_offset, leaf.right_child_offset, mask, hit_u, hit_v, its);
+        return;
+    }
+    for (int i = 0; i < 4 * p->num_groups; ++i)
+    {
+        if (mask & (1 << i))
+        {
+            if (type == PrimitiveType_Box)
+            {
+                intersect_box(leaf, p->rays[i], p->inv_dirs[i], &p->min_t[i], &its[i]);
+            }
+            else
+            {
+                intersect_sphere(leaf, p->rays[i], &p->min_t[i], &its[i]);
+            }
+        }
+    }
+}
+
+// trace() for every ray of `active` in the packet, into its[ray].
+static void trace_packet(Packet* p, const int active, Intersection* its)
+{
+    float hit_u[kMaxPacketRays];
+    float hit_v[kMaxPacketRays];
+    for (int i = 0; i < 4 * p->num_groups; ++i)
+    {
+        its[i].t = 0;
+        its[i].prim = -1;
+    }
+    if (m_num_nodes == 0 || active == 0)
+    {
+        return;
+    }
+    if (m_stackless)
+    {  // No escape offset walk for packets: the rays go alone.
+        for (int i = 0; i < 4 * p->num_groups; ++i)
+        {
+            if (active & (1 << i))
+            {
+                its[i] = trace(p->rays[i]);
+            }
+        }
+        return;
+    }
+
+    struct StackEntry
+    {
+        int node;
+        int mask;   // Rays that need the node.
+    };
+    // A node can push both its children, see below.
+    StackEntry stack[2 * kStackSize];
+    int stack_offset = 0;
+    int node_i = 0;
+    int mask = active;
+    float max_t = 1 << 16;  // Largest closest hit so far among the active rays.
+    while (true)
+    {
+        const BVHNode& node = m_nodes[node_i];
+        if (node.primitive_offset < 0)
+        {
+            const int left_i = node_i + 1;
+            const int right_i = get_right_child(node);
+            const int mask_l = packet_hits_box(*p, m_nodes[left_i].bbox, mask, max_t);
+            const int mask_r = packet_hits_box(*p, m_nodes[right_i].bbox, mask, max_t);
+            if (mask_l && mask_r)
+            {
+                // Rays that go down the split axis take the right child first, as
+                // in trace(). When the packet has both kinds, the left child is
+                // visited twice: before the right one for some rays, after it for
+                // the others.
+                const int right_first = p->neg_rays[get_split_axis(node)];
+                const int left_before = mask_l & ~right_first;
+                const int left_after = mask_l & right_first;
+                if (left_after)
+                {
+                    StackEntry later = { left_i, left_after };
+                    stack[stack_offset++] = later;
+                }
+                if (left_before)
+                {
+                    StackEntry later = { right_i, mask_r };
+                    stack[stack_offset++] = later;
+                }
+                node_i = left_before ? left_i : right_i;
+                mask = left_before ? left_before : mask_r;
+                continue;
+            }
+            if (mask_l || mask_r)
+            {
+                node_i = mask_l ? left_i : right_i;
+                mask = mask_l ? mask_l : mask_r;
+                continue;
+            }
+        }
+        else
+        {
+            intersect_leaf_packet(p, node, mask, hit_u, hit_v, its);
+            max_t = 0;
+            for (int i = 0; i < 4 * p->num_groups; ++i)
+            {
+                if (active & (1 << i))
+                {
+                    max_t = fmaxf(max_t, p->min_t[i]);
+                }
+            }
+        }
+        if (stack_offset == 0)
+        {
+            break;
+        }
+        --stack_offset;
+        node_i = stack[stack_offset].node;
+        mask = stack[stack_offset].mask;
+    }
+
+    for (int i = 0; i < 4 * p->num_groups; ++i)
+    {
+        if ((active & (1 << i)) && its[i].prim >= 0)
+        {
+            const Ray& ray = p->rays[i];
+            const CLpackedNormals& norm = m_norms[its[i].prim];
+            its[i].norm = (1 - hit_u[i] - hit_v[i]) * decode_normal(norm.n[0]) +
+                hit_u[i] * decode_normal(norm.n[1]) + hit_v[i] * decode_normal(norm.n[2]);
+            its[i].point = ray.o + its[i].t * ray.d;
+        }
+    }
+}
+
+// ==== Voxel grids
+
+struct DDA
+{
+    int     cell[3];
+    int     step[3];
+    float   t_next[3];
+    float   t_delta[3];
+};
+
+static void dda_start(
+        DDA* dda,
+        const float* o,
+        const float* d,
+        const float* inv_d,
+        const float* corner,
+        const float cell_size,
+        const int* n,
+        const float t)
+{
+    for (int k = 0; k < 3; ++k)
+    {
+        const float p = (o[k] + t * d[k] - corner[k]) / cell_size;
+        const int cell = (int)floorf(p);
+        dda->cell[k] = cell < 0 ? 0 : cell > n[k] - 1 ? n[k] - 1 : cell;
+        dda->step[k] = (d[k] < 0) ? -1 : 1;
+        const float boundary = corner[k] + (float)(dda->cell[k] + (d[k] < 0 ? 0 : 1)) * cell_size;
+        dda->t_next[k] = (boundary - o[k]) * inv_d[k];
+        dda->t_delta[k] = cell_size * fabsf(inv_d[k]);
+    }
+}
+
+static int dda_step(DDA* dda, float* t)
+{
+    const int k = (dda->t_next[0] < dda->t_next[1]) ?
+        ((dda->t_next[0] < dda->t_next[2]) ? 0 : 2) :
+        ((dda->t_next[1] < dda->t_next[2]) ? 1 : 2);
+    *t = dda->t_next[k];
+    dda->cell[k] += dda->step[k];
+    dda->t_next[k] += dda->t_delta[k];
+    return k;
+}
+
+static Intersection trace_grid(const Ray& ray, const float max_t)
+{
+    Intersection its;
+    its.t = 0;
+    its.prim = -1;
+    const glm::vec3 inv_dir = inverse_dir(ray.d);
+    const float o[3] = { ray.o.x, ray.o.y, ray.o.z };
+    const float d[3] = { ray.d.x, ray.d.y, ray.d.z };
+    const float inv_d[3] = { inv_dir.x, inv_dir.y, inv_dir.z };
+    const float* origin = m_grid.origin;
+    const int* size = m_grid.size;
+    const int brick_cells[3] = { kBrickSize, kBrickSize, kBrickSize };
+    const float brick_size = kBrickSize * m_grid.voxel_size;
+
+    // Clip the ray to the grid. `axis` is the one of the face it enters through.
+    float t = 0;
+    float t_far = max_t;
+    int axis = -1;
+    for (int k = 0; k < 3; ++k)
+    {
+        const float t0 = (origin[k] - o[k]) * inv_d[k];
+        const float t1 = (origin[k] + (float)size[k] * brick_size - o[k]) * inv_d[k];
+        if (fminf(t0, t1) > t)
+        {
+            t = fminf(t0, t1);
+            axis = k;
+        }
+        t_far = fminf(t_far, fmaxf(t0, t1));
+    }
+    if (t >= t_far)
+    {
+        return its;
+    }
+
+    DDA outer;
+    dda_start(&outer, o, d, inv_d, origin, brick_size, size, t);
+    while (true)
+    {
+        const int brick = m_grid_cells[(outer.cell[2] * size[1] + outer.cell[1]) * size[0] + outer.cell[0]];
+        if (brick >= 0)
+        {
+            const float t_exit = fminf(fminf(outer.t_next[0], outer.t_next[1]), outer.t_next[2]);
+            float corner[3];
+            for (int k = 0; k < 3; ++k)
+            {
+                corner[k] = origin[k] + (float)outer.cell[k] * brick_size;
+            }
+            DDA inner;
+            dda_start(&inner, o, d, inv_d, corner, m_grid.voxel_size, brick_cells, t);
+            float t_in = t;
+            int axis_in = axis;
+            while (true)
+            {
+                const int bit = inner.cell[0] + kBrickSize * (inner.cell[1] + kBrickSize * inner.cell[2]);
+                if (t_in > 0 && (m_bricks[brick * kBrickWords + (bit >> 5)] & (1u << (bit & 31))))
+                {
+                    if (t_in < t_far)
+                    {  // The normal of the face the ray came in through.
+                        its.t = t_in;
+                        its.point = ray.o + t_in * ray.d;
+                        its.norm = glm::vec3(0);
+                        its.norm[axis_in] = (float)-inner.step[axis_in];
+                    }
+                    return its;
+                }
+                axis_in = dda_step(&inner, &t_in);
+                if (t_in >= t_exit || inner.cell[axis_in] < 0 || inner.cell[axis_in] >= kBrickSize)
+                {
+                    break;
+                }
+            }
+        }
+        axis = dda_step(&outer, &t);
+        if (t >= t_far || outer.cell[axis] < 0 || outer.cell[axis] >= size[axis])
+        {
+            return its;
+        }
+    }
+}
+
+////////////////////////////////////////
+// Rendering
+////////////////////////////////////////
+
+static float catmull(const float rsq, const float* K)
+{
+    const float scaled_val = 10 * rsq * 3.6f;
+    const float scaled_val_floor = fmaxf(0.0f, fminf(10.0f, floorf(scaled_val)));
+    const int k = (int)scaled_val_floor;
+    float p0, p1, m0, m1;
+    if (k == 0)
+    {
+        p0 = 1.0f;
+        m0 = K[1] - K[0];
+        p1 = K[1];
+        m1 = 0.5f * (K[2] - K[0]);
+    }
+    else
+    {
+        p0 = K[k];
+        m0 = 0.5f * (K[k + 1] - K[k - 1]);
+        p1 = K[k + 1];
+        m1 = 0.5f * (K[k + 2] - K[k]);
+    }
+    const float t = scaled_val - scaled_val_floor;
+    const float omt = 1 - t;
+    return (p0 * (1.0f + 2.0f * t) + m0 * t) * omt * omt +
+        (p1 * (1.0f + 2.0f * omt) - m1 * omt) * t * t;
+}
+
+static float eye_ray(const int x, const int y, const int eye_i, const vr::Eye* eyes, Ray* ray)
+{
+    const glm::vec4 entry = m_ray_table[(eye_i * m_height + y) * (m_width / 2) + x];
+    const vr::Eye& eye = eyes[eye_i];
+    const glm::vec3 eye_pos(eye.position[0], eye.position[1], eye.position[2]);
+    const glm::vec3 point = rotate_vector_quat(glm::vec3(entry), eye.orientation) + eye_pos;
+    ray->o = point;
+    ray->d = glm::normalize(point - eye_pos);
+    return entry.w;
+}
+
+static glm::vec3 scene_light()
+{
+    return glm::vec3(-3, 10, 5);
+}
+
+static float shade(const Intersection& its, const float lit)
+{
+    if (its.t > 0)
+    {
+        const glm::vec3 dir = glm::normalize(scene_light() - its.point);
+        return lit * fmaxf(glm::dot(its.norm, dir), 0.0f);
+    }
+    return 0.5f;
+}
+
+// Color of a primary ray's hit, with a shadow ray to the light if they are on.
+static float shade_primary(const Intersection& its, int64* shadow_rays)
+{
+    float lit = 1;
+    if (m_shadows && its.t > 0)
+    {
+        // Start off the surface so the ray does not hit it again.
+        Ray shadow_ray;
+        const glm::vec3 to_light = scene_light() - its.point;
+        const float light_t = glm::length(to_light);
+        shadow_ray.d = to_light / light_t;
+        shadow_ray.o = its.point + 1e-3f * shadow_ray.d;
+        const bool in_shadow = m_voxel_grid ?
+            trace_grid(shadow_ray, light_t).t > 0 : occluded(shadow_ray, light_t);
+        lit = in_shadow ? 0.0f : 1.0f;
+        *shadow_rays += 1;
+    }
+    return shade(its, lit);
+}
+
+static void write_pixel(RenderJob* job, const int x, const int y, const int eye_i, const float color)
+{
+    const int viewport_w = m_width / 2;
+    float* out = &job->image[4 * ((size_t)y * (size_t)m_width + (size_t)(x + eye_i * viewport_w))];
+    for (int c = 0; c < 4; ++c)
+    {
+        out[c] = color;
+    }
+}
+
+// The pixels of [x0, x1) * [y0, y1) in blocks of m_packet_w * m_packet_h, one
+// packet each. Pixels outside the lenses stay out of the packet's active mask.
+static void render_packets(RenderJob* job, const int eye_i, const int x0, const int y0, const int x1, const int y1,
+        int64* primary_rays, int64* shadow_rays)
+{
+    Packet packet;
+    Ray rays[kMaxPacketRays];
+    Intersection its[kMaxPacketRays];
+    const int num_rays = m_packet_w * m_packet_h;
+    for (int by = y0; by < y1; by += m_packet_h)
+    {
+        for (int bx = x0; bx < x1; bx += m_packet_w)
+        {
+            // Rays that are not traced still fill their lanes. The block's first
+            // pixel is always in the tile, so its ray is finite.
+            Ray filler;
+            eye_ray(bx, by, eye_i, job->eyes, &filler);
+            int active = 0;
+            for (int i = 0; i < num_rays; ++i)
+            {
+                const int x = bx + i % m_packet_w;
+                const int y = by + i / m_packet_w;
+                rays[i] = filler;
+                if (x < x1 && y < y1 && eye_ray(x, y, eye_i, job->eyes, &rays[i]) < kLensRadiusSq)
+                {
+                    active |= 1 << i;
+                }
+            }
+            if (active == 0)
+            {
+                for (int i = 0; i < num_rays; ++i)
+                {
+                    const int x = bx + i % m_packet_w;
+                    const int y = by + i / m_packet_w;
+                    if (x < x1 && y < y1)
+                    {
+                        write_pixel(job, x, y, eye_i, 0);
+                    }
+                }
+                continue;
+            }
+            make_packet(&packet, rays, num_rays, active);
+            trace_packet(&packet, active, its);
+            for (int i = 0; i < num_rays; ++i)
+            {
+                const int x = bx + i % m_packet_w;
+                const int y = by + i / m_packet_w;
+                if (x < x1 && y < y1)
+                {
+                    float color = 0;
+                    if (active & (1 << i))
+                    {
+                        color = shade_primary(its[i], shadow_rays);
+                        *primary_rays += 1;
+                    }
+                    write_pixel(job, x, y, eye_i, color);
+                }
+            }
+        }
+    }
+}
+
+static void render_tile(RenderJob* job, const int64 tile, int64* primary_rays, int64* shadow_rays)
+{
+    const int viewport_w = m_width / 2;
+    const int tiles_x = (viewport_w + kTileSize - 1) / kTileSize;
+    const int tiles_y = (m_height + kTileSize - 1) / kTileSize;
+    const int eye_i = (int)(tile / (tiles_x * tiles_y));
+    const int tile_i = (int)(tile % (tiles_x * tiles_y));
+    const int x0 = (tile_i % tiles_x) * kTileSize;
+    const int y0 = (tile_i / tiles_x) * kTileSize;
+    const int x1 = (x0 + kTileSize < viewport_w) ? x0 + kTileSize : viewport_w;
+    const int y1 = (y0 + kTileSize < m_height) ? y0 + kTileSize : m_height;
+    // The grid has no tree to share between rays.
+    if (m_packet_w * m_packet_h > 1 && !m_voxel_grid)
+    {
+        render_packets(job, eye_i, x0, y0, x1, y1, primary_rays, shadow_rays);
+        return;
+    }
+    for (int y = y0; y < y1; ++y)
+    {
+        for (int x = x0; x < x1; ++x)
+        {
+            Ray ray;
+            const float rsq = eye_ray(x, y, eye_i, job->eyes, &ray);
+            float color = 0;
+            if (rsq < kLensRadiusSq)
+            {
+                const Intersection its = m_voxel_grid ? trace_grid(ray, 1 << 16) : trace(ray);
+                *primary_rays += 1;
+                color = shade_primary(its, shadow_rays);
+            }
+            write_pixel(job, x, y, eye_i, color);
+        }
+    }
+}
+
+static void render_tiles(RenderJob* job)
+{
+    int64 primary_rays = 0;
+    int64 shadow_rays = 0;
+    for (;;)
+    {
+        const int64 tile = fetch_add(&job->next_tile, 1);
+        if (tile >= job->num_tiles)
+        {
+            break;
+        }
+        render_tile(job, tile, &primary_rays, &shadow_rays);
+    }
+    fetch_add(&job->primary_rays, primary_rays);
+    fetch_add(&job->shadow_rays, shadow_rays);
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI render_thread(LPVOID job)
+{
+    render_tiles((RenderJob*)job);
+    return 0;
+}
+#else
+static void* render_thread(void* job)
+{
+    render_tiles((RenderJob*)job);
+    return NULL;
+}
+#endif
+
+void init(int num_threads)
+{
+    if (num_threads <= 0)
+    {
+        num_threads = get_num_cores();
+    }
+    m_num_threads = (num_threads < 1) ? 1 : (num_threads > kMaxThreads) ? kMaxThreads : num_threads;
+    m_initialized = true;
+    logf("CPU tracer: %d threads\n", m_num_threads);
+}
+
+bool is_initialized()
+{
+    return m_initialized;
+}
+
+void set_triangle_soup(ph::CLtriangle* tris, ph::CLpackedNormals* norms, size_t num_tris)
+{
+    if (m_tris) { phree(m_tris); }
+    if (m_norms) { phree(m_norms); }
+    if (num_tris > 0)
+    {
+        m_tris = phalloc(CLwoopTriangle, num_tris);
+        m_norms = phalloc(CLpackedNormals, num_tris);
+        for (size_t i = 0; i < num_tris; ++i)
+        {
+            m_tris[i] = make_woop_triangle(tris[i]);
+        }
+        memcpy(m_norms, norms, num_tris * sizeof(CLpackedNormals));
+    }
+}
+
+static int get_bvh_depth(ph::BVHNode* tree, int node_i)
+{
+    if (tree[node_i].primitive_offset >= 0)
+    {
+        return 0;
+    }
+    int depth_l = get_bvh_depth(tree, node_i + 1);
+    int depth_r = get_bvh_depth(tree, get_right_child(tree[node_i]));
+    return 1 + (depth_l > depth_r ? depth_l : depth_r);
+}
+
+void set_flat_bvh(ph::BVHNode* tree, size_t num_nodes)
+{
+    if (m_nodes) { phree(m_nodes); }
+    m_num_nodes = (int64)num_nodes;
+    if (num_nodes > 0)
+    {
+        // Every node on the stack is the sibling of one on the path from the root.
+        m_stackless = get_bvh_depth(tree, 0) > kStackSize;
+        if (m_stackless)
+        {
+            logf("CPU tracer: BVH deeper than %d levels, tracing without a stack\n", kStackSize);
+        }
+        m_nodes = phalloc(BVHNode, num_nodes);
+        memcpy(m_nodes, tree, num_nodes * sizeof(BVHNode));
+    }
+}
+
+void set_voxel_grid(ph::CLvoxelGrid* grid, int* cells, size_t num_cells,
+        uint32_t* bricks, size_t num_brick_words)
+{
+    if (m_grid_cells) { phree(m_grid_cells); }
+    if (m_bricks) { phree(m_bricks); }
+    m_voxel_grid = grid != NULL;
+    if (grid)
+    {
+        m_grid = *grid;
+        m_grid_cells = phalloc(int, num_cells);
+        memcpy(m_grid_cells, cells, num_cells * sizeof(int));
+        // Empty grids have no bricks.
+        m_bricks = phalloc(uint32_t, num_brick_words > 0 ? num_brick_words : 1);
+        memcpy(m_bricks, bricks, num_brick_words * sizeof(uint32_t));
+    }
+}
+
+void set_hmd(const vr::HMDConsts& consts, const float* K, int num_coefficients, int width, int height)
+{
+    ph_assert(num_coefficients >= 3 && num_coefficients <= kMaxCoefficients);
+    // catmull() reads up to two past the last coefficient, out of the lens circle.
+    float padded_K[kMaxCoefficients + 2];
+    for (int i = 0; i < kMaxCoefficients + 2; ++i)
+    {
+        padded_K[i] = K[(i < num_coefficients) ? i : num_coefficients - 1];
+    }
+
+    if (m_ray_table) { phree(m_ray_table); }
+    m_width = width;
+    m_height = height;
+    const int viewport_w = width / 2;
+    m_ray_table = phalloc(glm::vec4, width * height);
+    const float ar = (float)height / (float)viewport_w;
+    for (int eye_i = 0; eye_i < 2; ++eye_i)
+    {
+        for (int y = 0; y < height; ++y)
+        {
+            for (int x = 0; x < viewport_w; ++x)
+            {
+                glm::vec3 point((float)x / (float)viewport_w, (float)y / (float)height, 0);
+                point.x -= consts.lens_centers[eye_i][0] / consts.viewport_size_m[0];
+                point.y -= consts.lens_centers[eye_i][1] / consts.viewport_size_m[1];
+                point.y *= ar;
+                const float rsq = point.x * point.x + point.y * point.y;
+                point *= catmull(rsq, padded_K);
+                point.z -= consts.eye_to_screen;
+                m_ray_table[(eye_i * height + y) * viewport_w + x] = glm::vec4(point, rsq);
+            }
+        }
+    }
+}
+
+void toggle_shadows()
+{
+    m_shadows = !m_shadows;
+}
+
+void set_packet_size(int num_rays)
+{
+    if (num_rays != 1 && num_rays != 4 && num_rays != 8 && num_rays != 16)
+    {
+        phatal_error("CPU tracer packets are 1, 4, 8 or 16 rays");
+    }
+    // As square as they go: 1x1, 2x2, 4x2, 4x4.
+    m_packet_w = (num_rays >= 8) ? 4 : (num_rays == 4) ? 2 : 1;
+    m_packet_h = num_rays / m_packet_w;
+}
+
+void render(const vr::Eye* eyes, float* image, RenderStats* stats)
+{
+    PH_PROFILE_SCOPE("cpu_render");
+    if (!m_initialized || !m_ray_table)
+    {
+        phatal_error("cpu::render needs cpu::init and cpu::set_hmd first");
+    }
+    uint64 begin_us = io::get_microseconds();
+
+    const int tiles_x = (m_width / 2 + kTileSize - 1) / kTileSize;
+    const int tiles_y = (m_height + kTileSize - 1) / kTileSize;
+    RenderJob job = {};
+    job.eyes = eyes;
+    job.image = image;
+    job.num_tiles = 2 * tiles_x * tiles_y;
+
+    // This thread renders too. Threads pull tiles until there are none left, so
+    // when one fails to start the others take its share.
+    int num_started = 0;
+#if defined(_WIN32)
+    HANDLE threads[kMaxThreads];
+    for (int i = 1; i < m_num_threads; ++i)
+    {
+        threads[num_started] = CreateThread(NULL, 0, render_thread, &job, 0, NULL);
+        if (threads[num_started] == NULL)
+        {
+            break;
+        }
+        ++num_started;
+    }
+#else
+    pthread_t threads[kMaxThreads];
+    for (int i = 1; i < m_num_threads; ++i)
+    {
+        if (pthread_create(&threads[num_started], NULL, render_thread, &job) != 0)
+        {
+            break;
+        }
+        ++num_started;
+    }
+#endif
+    if (num_started + 1 < m_num_threads)
+    {
+        logf("CPU tracer: could only start %d of %d render threads\n", num_started + 1, m_num_threads);
+    }
+    render_tiles(&job);
+#if defined(_WIN32)
+    for (int i = 0; i < num_started; ++i)
+    {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+#else
+    for (int i = 0; i < num_started; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+#endif
+
+    uint64 elapsed_us = io::get_microseconds() - begin_us;
+    if (stats)
+    {
+        stats->render_ms = (float)elapsed_us / 1000.0f;
+        stats->primary_rays = job.primary_rays;
+        stats->shadow_rays = job.shadow_rays;
+        stats->mrays_per_s = (elapsed_us > 0) ?
+            (float)(job.primary_rays + job.shadow_rays) / (float)elapsed_us : 0.0f;
+    }
+}
+
+bool write_ppm(const char* path, const float* image, int width, int height)
+{
+    FILE* fd = fopen(path, "wb");
+    if (!fd)
+    {
+        return false;
+    }
+    fprintf(fd, "P6\n%d %d\n255\n", width, height);
+    unsigned char* row = phalloc(unsigned char, 3 * width);
+    // PPM rows go down from the top.
+    for (int y = height - 1; y >= 0; --y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            for (int c = 0; c < 3; ++c)
+            {
+                const float v = image[4 * ((size_t)y * (size_t)width + (size_t)x) + (size_t)c];
+                row[3 * x + c] = (unsigned char)(fmaxf(0.0f, fminf(1.0f, v)) * 255 + 0.5f);
+            }
+        }
+        fwrite(row, 3, (size_t)width, fd);
+    }
+    phree(row);
+    fclose(fd);
+    return true;
+}
+
+void deinit()
+{
+    if (m_tris) { phree(m_tris); }
+    if (m_norms) { phree(m_norms); }
+    if (m_nodes) { phree(m_nodes); }
+    if (m_grid_cells) { phree(m_grid_cells); }
+    if (m_bricks) { phree(m_bricks); }
+    if (m_ray_table) { phree(m_ray_table); }
+    m_num_nodes = 0;
+    m_stackless = false;
+    m_voxel_grid = false;
+    m_initialized = false;
+}
+
+}  // ns cpu
+}  // ns ph
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <ph.h>
+
+#include "vr.h"
+
+////////////////////////////////////////
+// ph::cpu
+// Native ray tracer. Traces the same
+// flat BVH, triangles and voxel grids
+// scene.cc uploads to the OpenCL tracer
+// and renders the image tracer.cl main
+// renders at full rate, without reuse.
+//
+// SSE box and triangle tests; primary
+// rays walk the tree in packets. Tiles
+// are spread over one thread per core.
+//
+// For machines without an OpenCL
+// device, as a reference for the GPU
+// tracer, and as a Mrays/s baseline.
+// Usage example:
+//
+//  cpu::init();
+//  cpu::set_hmd(vr::get_hmd_constants(), K, 11, 1280, 720);
+//  scene::upload_everything();     // Uploads to the CPU tracer too.
+//  cpu::render(eyes, image, &stats);
+////////////////////////////////////////
+
+namespace ph
+{
+struct CLtriangle;
+struct CLpackedNormals;
+struct BVHNode;
+struct CLvoxelGrid;
+
+namespace cpu
+{
+
+struct RenderStats
+{
+    float render_ms;
+    int64 primary_rays;
+    int64 shadow_rays;
+    float mrays_per_s;      // Primary and shadow rays.
+};
+
+// `num_threads` 0 uses one per core. scene::upload_everything() only uploads
+// to the CPU tracer once it is initialized.
+void init(int num_threads = 0);
+bool is_initialized();
+
+// Same as the ocl:: functions of the same name.
+void set_triangle_soup(ph::CLtriangle* tris, ph::CLpackedNormals* norms, size_t num_tris);
+void set_flat_bvh(ph::BVHNode* tree, size_t num_nodes);
+void set_voxel_grid(ph::CLvoxelGrid* grid, int* cells, size_t num_cells,
+        uint32_t* bricks, size_t num_brick_words);
+
+// Lenses and screen to render for, and the size of the image: both eyes side
+// by side, like the OpenCL render target. Builds the ray table, see tracer.cl ray_table.
+void set_hmd(const vr::HMDConsts& consts, const float* K, int num_coefficients, int width, int height);
+
+// Shadow rays from every hit to the light, like ocl::toggle_shadows().
+void toggle_shadows();
+
+// Rays of neighbouring pixels are traced together, as packets of 1 (alone), 4,
+// 8 or 16 rays. Primary rays through the BVH only. Defaults to 16.
+void set_packet_size(int num_rays);
+
+// Render both eyes into `image`, width * height RGBA floats, rows from the
+// bottom like the OpenCL render target.
+// Pixels outside the lens circles are black.
+void render(const vr::Eye* eyes, float* image, RenderStats* stats);
+
+// Binary PPM of an image from render(), upright: PPM rows go from the top, so
+// they are written in reverse. Returns false if the file can't be written.
+bool write_ppm(const char* path, const float* image, int width, int height);
+
+void deinit();
+
+}  // ns cpu
+}  // ns ph
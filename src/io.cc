@@ -92,12 +92,8 @@ void get_wasd_camera(const float* quat, float* out_xyz)
     out_xyz[2] = wasd_camera[2];
 }
 
-void wasd_callback(GLFWwindow* window, int key, int /*scancode*/, int action, int /*mods*/)
+void wasd_callback(GLFWwindow* /*window*/, int key, int /*scancode*/, int action, int /*mods*/)
 {
-    if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
-{
-        glfwSetWindowShouldClose(window, GL_TRUE);
-    }
     if (key == GLFW_KEY_W && action == GLFW_PRESS)
 {
        wasd_pressed |= Control_W;
@@ -152,17 +148,20 @@ uint64 get_microseconds()
 {
 #ifdef _WIN32
     LARGE_INTEGER ticks;
-    LARGE_INTEGER ticks_per_sec;
-    QueryPerformanceFrequency(&ticks_per_sec);
+    static LARGE_INTEGER ticks_per_sec = {};
+    if (ticks_per_sec.QuadPart == 0)
+    {
+        QueryPerformanceFrequency(&ticks_per_sec);
+    }
     QueryPerformanceCounter(&ticks);
-
-    ticks.QuadPart *= 1000000;  // Avoid precision loss;
-    return (uint64)(ticks.QuadPart / ticks_per_sec.QuadPart);
+    // Split to avoid overflow on long uptimes.
+    uint64 secs = (uint64)(ticks.QuadPart / ticks_per_sec.QuadPart);
+    uint64 rem  = (uint64)(ticks.QuadPart % ticks_per_sec.QuadPart);
+    return secs * 1000000 + (rem * 1000000) / (uint64)ticks_per_sec.QuadPart;
 #else
     struct timespec tp;
-    clock_gettime(CLOCK_REALTIME, &tp);
-    long ns = tp.tv_nsec;
-    return (uint64)(ns * 1000);
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (uint64)tp.tv_sec * 1000000 + (uint64)tp.tv_nsec / 1000;
 #endif
 }
 
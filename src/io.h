@@ -28,11 +28,13 @@ void set_wasd_camera(float x, float y, float z);
 
 void set_wasd_step(float step);
 
+// Key callback that moves the WASD camera. Leaves the other keys to the caller.
 void wasd_callback(GLFWwindow* window, int key, int /*scancode*/, int action, int /*mods*/);
 
 void get_wasd_camera(const float* orientation, float* out_xyz);
 // ====================================
 
+// Microseconds from a monotonic clock.
 uint64_t get_microseconds();
 
 }
@@ -1,6 +1,7 @@
 #include "mesh.h"
 
 #include "AABB.h"
+#include "profiler.h"
 
 namespace ph
 {
@@ -17,6 +18,7 @@ static const char* str(const glm::vec3& v)
 
 scene::Chunk load_obj(const char* path, float scale)
 {
+    PH_PROFILE_SCOPE("load_obj");
     char* model_str_raw = (char *)io::slurp(path);
 
     typedef char* charptr;
@@ -244,6 +246,7 @@ static Bound make_bound(int64 a, int64 b)
 
 Slice<scene::Chunk> shatter(scene::Chunk big_chunk, int limit)
 {
+    PH_PROFILE_SCOPE("shatter");
     auto slice = MakeSlice<scene::Chunk>(1);  // The thing that we return
 
     auto size = big_chunk.num_verts;
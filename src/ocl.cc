@@ -6,6 +6,7 @@
 
 #include "io.h"
 #include "ph_gl.h"
+#include "profiler.h"
 #include "scene.h"  // Should not be necessary once this is a standalone module
 #include "vr.h"
 #include "window.h"
@@ -22,16 +23,14 @@ struct RenderTarget
 static const int k_rift_width = 1920;
 static const int k_rift_height = 1080;
 //////////
-// 16:9 resolutions:
+// 16:9 resolutions (the size is set in ocl.h):
 //////////
-/* static const int width = 1920;        /// 8 x 8 */
-/* static const int height = 1080; */
-/* static const int width = 1600;       /// 16 x 4 */
-/* static const int height = 900; */
-static const int width = 1280;        /// 8 x 8
-static const int height = 720;
-/* static const int width = 960; */
-/* static const int height = 540; */
+/* 1920 x 1080        /// 8 x 8 */
+/* 1600 x 900         /// 16 x 4 */
+/* 1280 x 720         /// 8 x 8 */
+/* 960 x 540 */
+static const int width = ph::ocl::kRenderTargetWidth;
+static const int height = ph::ocl::kRenderTargetHeight;
 
 RenderTarget g_rendertarget;
 
@@ -70,7 +69,6 @@ namespace ph
 namespace ocl
 {
 
-static GLuint           m_gl_texture;
 static GLuint           m_quad_vao;
 static GLuint           m_quad_r_vao;
 static GLuint           m_quad_l_vao;
@@ -78,80 +76,403 @@ static GLuint           m_quad_program;
 static GLuint           m_postproc_program;
 static cl_context       m_context;
 static cl_command_queue m_queue;
-static cl_mem           m_cl_texture;
 static cl_mem           m_cl_triangle_soup;
 static cl_mem           m_cl_normal_soup;
-static cl_mem           m_cl_primitives;
 static cl_mem           m_cl_bvh;
+static cl_mem           m_cl_top_nodes;     // Top levels of m_cl_bvh, cached in local memory.
+static int              m_max_top_nodes;    // As many as fit in our share of local memory.
+static bool             m_stackless = false;
+static bool             m_shadows = false;
+static int              m_bvh_depth;        // Edges on the longest path from the root to a leaf.
+static bool             m_voxel_grid = false;   // Trace m_cl_voxel_grid instead of the BVH.
+static cl_mem           m_cl_voxel_grid;    // A CLvoxelGrid. NULL for BVH scenes.
+static cl_mem           m_cl_grid_cells;
+static cl_mem           m_cl_bricks;
+static cl_mem           m_cl_frame_params;
+static cl_mem           m_cl_counters;      // [0] tile queue, [1] rays traced.
+static cl_mem           m_cl_ray_table;
 static cl_program       m_cl_program;
 static cl_kernel        m_cl_kernel;
 static vr::HMDConsts    m_hmd_consts;
 static bool             m_tw_enabled;
+static size_t           m_num_work_groups;  // Persistent groups in flight; see tracer.cl main.
+
+// ==== Foveation
+// Shading rate drops with distance from the lens center, by rsq. See the tile
+// levels in tracer.cl.
+// Stereo tiles are full rate and cover both eyes: each work item traces the
+// same pixel in the left and right viewports with one traversal.
+enum
+{
+    Shading_Full,
+    Shading_Foveated,
+    Shading_Stereo,
+    Shading_Count,
+};
+
+static bool             m_foveated = true;
+static bool             m_stereo = false;           // Overrides m_foveated.
+static bool             m_stereo_reuse = false;     // Ignored when m_stereo.
+static float            m_fovea_full_rsq = 0.07f;   // Every pixel traced inside.
+static float            m_fovea_half_rsq = 0.18f;   // Checkerboard inside, one in four outside.
+static cl_mem           m_cl_tiles[Shading_Count];
+static int              m_num_tiles[Shading_Count];
+// The same lists split by eye, for stereo reuse. NULL when empty.
+static cl_mem           m_cl_eye_tiles[Shading_Count][vr::EYE_Count];
+static int              m_num_eye_tiles[Shading_Count][vr::EYE_Count];
+static cl_mem           m_cl_block_levels;
+
+// ==== Temporal reuse
+// Per-pixel color, hit and hit triangle caches, ping-ponged by frame parity.
+// See the temporal reuse notes in tracer.cl.
+static bool             m_temporal = true;
+static bool             m_cache_dirty = true;   // Scene or shading changed; cached hits are meaningless.
+static cl_mem           m_cl_cache_color[2];
+static cl_mem           m_cl_cache_hit[2];
+static cl_mem           m_cl_cache_tri[2];
+static cl_kernel        m_cl_invalidate_kernel;
+static vr::Eye          m_prev_eyes[2];
+static cl_kernel        m_cl_reconstruct_kernel;
+
+// Argument indices of the `main` kernel in tracer.cl.
+enum
+{
+    Arg_Image,
+    Arg_FrameParams,
+    Arg_ViewportSizePx,
+    Arg_RayTable,
+    Arg_Tris,
+    Arg_Norms,
+    Arg_Nodes,
+    Arg_Counters,
+    Arg_Tiles,
+    Arg_NumTiles,
+    Arg_CacheColor,
+    Arg_CacheHit,
+    Arg_CacheTri,
+    Arg_PrevColor,
+    Arg_PrevHit,
+    Arg_PrevTri,
+    Arg_TopNodesSrc,
+    Arg_NumTopNodes,
+    Arg_TopNodes,
+    Arg_VoxelGrid,
+    Arg_GridCells,
+    Arg_Bricks,
+};
+
+// Argument indices of the `reconstruct` kernel.
+enum
+{
+    Reconstruct_Image,
+    Reconstruct_ViewportSizePx,
+    Reconstruct_RayTable,
+    Reconstruct_ColorBuffer,
+    Reconstruct_BlockLevels,
+    Reconstruct_Tiles,
+};
+
+// Mirrors FrameParams in tracer.cl.
+struct FrameParams
+{
+    vr::Eye eyes[2];
+    vr::Eye prev_eyes[2];
+    float   lens_centers[2][2];
+    float   viewport_size_m[2];
+    float   eye_to_screen;
+    int     foveated;
+    int     temporal;
+    int     frame_index;
+    int     stereo;
+    int     stereo_reuse;
+    int     stackless;
+    float   K[11];
+    int     shadows;
+    int     voxel_grid;
+    int     _padding[2];
+};
+static_assert(sizeof(FrameParams) == 240, "FrameParams must match its size in tracer.cl");
+// Offsets with the CL alignment rules: Eye and float2 fields are aligned to 16 and 8 bytes.
+static_assert(offsetof(FrameParams, lens_centers) == 128, "FrameParams layout differs from tracer.cl");
+static_assert(offsetof(FrameParams, eye_to_screen) == 152, "FrameParams layout differs from tracer.cl");
+static_assert(offsetof(FrameParams, K) == 180, "FrameParams layout differs from tracer.cl");
+static_assert(offsetof(FrameParams, voxel_grid) == 228, "FrameParams layout differs from tracer.cl");
+
+// Fields of FrameParams that only change with the HMD. Filled at init.
+static FrameParams m_base_params;
+
+// Work groups per compute unit for the persistent kernel. Enough to hide latency.
+static const int kGroupsPerComputeUnit = 16;
+
+// A tile is what one work group shades per trip through the tile queue.
+// Keep kTileWidth * kTileHeight in sync with TILE_RAYS in tracer.cl
+static const int kTileWidth = 16;
+static const int kTileHeight = 4;
+
+// Pixels with a (lens centered, aspect corrected) squared radius above this are
+// not visible through the lens. Must match the test in tracer.cl main.
+static const float kLensRadiusSq = 0.25f;
+
+// Size of the traversal stacks in tracer.cl trace() and trace_stereo(). Deeper
+// trees are traced with trace_stackless().
+static const int kTraceStackSize = 32;
+// Local memory main() declares itself (tile directions and a few ints), in bytes.
+static const int kMainLocalBytes = 2 * kTileWidth * kTileHeight * 4 * sizeof(float) + 64;
 
 static int64 m_num_frames = 1;
 static float m_avg_render = 0.0f;
 
+// ==== Render target ring
+// CL traces frame N into one slot while GL timewarps and presents frame N-1
+// from another. Neither side waits for the other to finish a whole frame:
+//  - Before CL writes a slot, it waits for the GL fence placed after the
+//    slot was last presented (on the device with cl_khr_gl_event, else on the host).
+//  - Before GL samples a slot, the host waits for its CL release event. It was
+//    queued a frame earlier, so this only blocks when the device falls behind.
+static const int kNumRenderTargets = 2;
+
+struct RenderSlot
+{
+    GLuint              gl_texture;
+    cl_mem              cl_texture;
+    GLsync              gl_done;    // GL has sampled this slot. 0 until first presented.
+    cl_event            cl_done;    // CL released this slot to GL. NULL when not in flight.
+    vr::RenderEyePose   eye_pose;   // Pose this slot was traced with, for timewarp.
+    FrameParams         params;     // Source of the async params upload. Kept until cl_done.
+};
+
+typedef cl_event (CL_API_CALL *CreateEventFromGLsyncFn)(cl_context, cl_GLsync, cl_int*);
+
+static RenderSlot               m_slots[kNumRenderTargets];
+static CreateEventFromGLsyncFn  m_create_event_from_gl_sync = NULL;  // NULL without cl_khr_gl_event
+
+// ==== Device timing
+// Each frame's events are kept until the device is done with them and read
+// back later, so collecting timings never blocks the host.
+enum
+{
+    Pass_Acquire,
+    Pass_Trace,
+    Pass_TraceRightEye, // NULL unless the right eye is traced apart, for stereo reuse.
+    Pass_Reconstruct,   // NULL when not foveated.
+    Pass_Release,
+    Pass_Count,
+};
+
+struct PendingFrame
+{
+    bool     in_use;
+    cl_event events[Pass_Count];
+    float    host_ms;
+    cl_int   rays_traced;   // Read back from counters[1].
+};
+
+static const int kMaxPendingFrames = 4;
+
+static PendingFrame m_pending_frames[kMaxPendingFrames];
+static int64        m_frame_counter = 0;
+static FrameStats   m_last_stats;
+static FrameStats   m_sum_stats;
+static int64        m_num_stats = 0;
+static int64        m_sum_rays = 0;     // Summed apart from m_sum_stats; an int would overflow.
+
 void __stdcall context_callback(
         const char* errinfo, const void* /*private_info*/, size_t /*cb*/, void* /*user_data*/)
 {
     logf("OpenCL context error:  %s\n", errinfo);
 }
 
-void set_flat_bvh(ph::BVHNode* tree, size_t num_nodes)
+// Number of nodes of the subtree at `node_i` down to `max_depth`, counting the cut.
+static int count_top_nodes(ph::BVHNode* tree, int node_i, int depth, int max_depth)
+{
+    if (tree[node_i].primitive_offset >= 0 || depth == max_depth)
+    {
+        return 1;
+    }
+    return 1 +
+        count_top_nodes(tree, node_i + 1, depth + 1, max_depth) +
+        count_top_nodes(tree, get_right_child(tree[node_i]), depth + 1, max_depth);
+}
+
+// Copy the subtree at `node_i` down to `max_depth` into `top`, depth first.
+// Inner nodes at max_depth become portals back into `tree`. Returns the index in `top`.
+static int copy_top_nodes(ph::BVHNode* tree, int node_i, int depth, int max_depth,
+        ph::BVHNode* top, int* num_top)
+{
+    int top_i = (*num_top)++;
+    top[top_i] = tree[node_i];
+    if (tree[node_i].primitive_offset >= 0)
+    {
+        return top_i;
+    }
+    if (depth == max_depth)
+    {
+        top[top_i].right_child_offset = node_i;
+    }
+    else
+    {
+        copy_top_nodes(tree, node_i + 1, depth + 1, max_depth, top, num_top);  // Lands on top_i + 1
+        int right_i = copy_top_nodes(tree, get_right_child(tree[node_i]), depth + 1, max_depth, top, num_top);
+        top[top_i].right_child_offset = (get_split_axis(tree[node_i]) << kSplitAxisShift) | kLocalNodeBit | right_i;
+    }
+    // Escape within the copy. Its last subtrees escape to kLocalNodeBit | size.
+    top[top_i].primitive_offset = -(kLocalNodeBit | *num_top);
+    return top_i;
+}
+
+static int get_bvh_depth(ph::BVHNode* tree, int node_i)
+{
+    if (tree[node_i].primitive_offset >= 0)
+    {
+        return 0;
+    }
+    int depth_l = get_bvh_depth(tree, node_i + 1);
+    int depth_r = get_bvh_depth(tree, get_right_child(tree[node_i]));
+    return 1 + (depth_l > depth_r ? depth_l : depth_r);
+}
+
+// Upload the top levels of `tree` that fit in m_max_top_nodes for main() to cache.
+static void set_top_nodes(ph::BVHNode* tree, size_t num_nodes)
 {
     cl_int err = CL_SUCCESS;
-    static bool been_called = false;
-    if (been_called)
+    if (m_cl_top_nodes)
     {
-        clReleaseMemObject(m_cl_bvh);
+        clReleaseMemObject(m_cl_top_nodes);
     }
-    been_called = true;
-    if (num_nodes == 0)
+    int max_depth = -1;
+    int num_top = 0;
+    for (int depth = 0; num_nodes > 0 && depth < 32; ++depth)
+    {
+        int n = count_top_nodes(tree, 0, 0, depth);
+        if (n > m_max_top_nodes)
+        {
+            break;
+        }
+        max_depth = depth;
+        if (n == num_top)
+        {
+            break;  // The whole tree fits.
+        }
+        num_top = n;
+    }
+    // Not even the root fits: upload a dummy node and leave the cache off.
+    ph::BVHNode* top = phalloc(ph::BVHNode, max_depth >= 0 ? num_top : 1);
+    num_top = 0;
+    if (max_depth >= 0)
     {
-        return;
+        copy_top_nodes(tree, 0, 0, max_depth, top, &num_top);
     }
-    m_cl_bvh = clCreateBuffer(m_context,
+    m_cl_top_nodes = clCreateBuffer(m_context,
             CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-            num_nodes * sizeof(BVHNode), (void*) tree, &err);
+            (num_top ? num_top : 1) * sizeof(BVHNode), (void*)top, &err);
+    phree(top);
     if (err != CL_SUCCESS)
     {
-        phatal_error("I couldn't create flat bvh CL buffer");
+        phatal_error("Can't create top node CL buffer");
     }
     err = clSetKernelArg(m_cl_kernel,
-            11, sizeof(cl_mem), (void*)&m_cl_bvh);
-    if (err != CL_SUCCESS) { phatal_error("Can't set kernel arg (bvh)"); }
+            Arg_TopNodesSrc, sizeof(cl_mem), (void*)&m_cl_top_nodes);
+    err |= clSetKernelArg(m_cl_kernel,
+            Arg_NumTopNodes, sizeof(cl_int), (void*)&num_top);
+    // A zero sized local argument is an error.
+    err |= clSetKernelArg(m_cl_kernel,
+            Arg_TopNodes, (num_top ? num_top : 1) * sizeof(BVHNode), NULL);
+    if (err != CL_SUCCESS)
+    {
+        phatal_error("Can't set kernel args (top nodes)");
+    }
+    logf("Caching %d of %d BVH nodes (%d levels) in local memory\n",
+            num_top, (int)num_nodes, max_depth + 1);
 }
 
-void set_primitive_array(ph::Primitive* prims, size_t num_prims)
+void set_flat_bvh(ph::BVHNode* tree, size_t num_nodes)
 {
     cl_int err = CL_SUCCESS;
     static bool been_called = false;
-    if (been_called)
+    if (been_called && m_cl_bvh)
     {
-        if (m_cl_primitives != NULL)
+        clReleaseMemObject(m_cl_bvh);
+        m_cl_bvh = NULL;
+    }
+    been_called = true;
+    // Voxel grid scenes have no tree. The tracer gets a NULL one, which it never reads.
+    if (num_nodes > 0)
+    {
+        m_cl_bvh = clCreateBuffer(m_context,
+                CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                num_nodes * sizeof(BVHNode), (void*) tree, &err);
+        if (err != CL_SUCCESS)
         {
-            clReleaseMemObject(m_cl_primitives);
-            m_cl_primitives = NULL;
+            phatal_error("I couldn't create flat bvh CL buffer");
         }
     }
-    been_called = true;
-    if (num_prims == 0)
+    err = clSetKernelArg(m_cl_kernel,
+            Arg_Nodes, sizeof(cl_mem), (void*)&m_cl_bvh);
+    if (err != CL_SUCCESS) { phatal_error("Can't set kernel arg (bvh)"); }
+    set_top_nodes(tree, num_nodes);
+    m_bvh_depth = num_nodes > 0 ? get_bvh_depth(tree, 0) : 0;
+    if (m_bvh_depth > kTraceStackSize)
     {
-        return;
+        logf("BVH is %d levels deep. Tracing without a stack.\n", m_bvh_depth);
     }
-    m_cl_primitives = clCreateBuffer(m_context,
-            CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-            num_prims * sizeof(ph::Primitive), (void*) prims, &err);
-    if (err != CL_SUCCESS)
+    m_cache_dirty = true;
+}
+
+void set_voxel_grid(ph::CLvoxelGrid* grid, int* cells, size_t num_cells,
+        uint32_t* bricks, size_t num_brick_words)
+{
+    cl_int err = CL_SUCCESS;
+    cl_mem* buffers[] = { &m_cl_voxel_grid, &m_cl_grid_cells, &m_cl_bricks };
+    for (int i = 0; i < 3; ++i)
     {
-        phatal_error("I couldn't create primitive CL buffer");
+        if (*buffers[i])
+        {
+            clReleaseMemObject(*buffers[i]);
+            *buffers[i] = NULL;
+        }
+    }
+    if (grid)
+    {
+        m_cl_voxel_grid = clCreateBuffer(m_context,
+                CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                sizeof(CLvoxelGrid), (void*)grid, &err);
+        if (err != CL_SUCCESS)
+        {
+            phatal_error("Could not create voxel grid buffer");
+        }
+        m_cl_grid_cells = clCreateBuffer(m_context,
+                CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                num_cells * sizeof(int), (void*)cells, &err);
+        if (err != CL_SUCCESS)
+        {
+            phatal_error("Could not create grid cell buffer");
+        }
+        // An empty grid has no bricks.
+        if (num_brick_words > 0)
+        {
+            m_cl_bricks = clCreateBuffer(m_context,
+                    CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                    num_brick_words * sizeof(uint32_t), (void*)bricks, &err);
+            if (err != CL_SUCCESS)
+            {
+                phatal_error("Could not create brick buffer");
+            }
+        }
+        logf("Voxel grid: %d x %d x %d bricks, %d of them not empty\n",
+                grid->size[0], grid->size[1], grid->size[2], grid->num_bricks);
     }
     err = clSetKernelArg(m_cl_kernel,
-            10, sizeof(cl_mem), (void*)&m_cl_primitives);
-    if (err != CL_SUCCESS) { phatal_error("Can't set kernel arg (prims)"); }
+            Arg_VoxelGrid, sizeof(cl_mem), (void*)&m_cl_voxel_grid);
+    err |= clSetKernelArg(m_cl_kernel,
+            Arg_GridCells, sizeof(cl_mem), (void*)&m_cl_grid_cells);
+    err |= clSetKernelArg(m_cl_kernel,
+            Arg_Bricks, sizeof(cl_mem), (void*)&m_cl_bricks);
+    if (err != CL_SUCCESS) { phatal_error("Can't set kernel args (voxel grid)"); }
+    m_voxel_grid = grid != NULL;
+    m_cache_dirty = true;
 }
 
-void set_triangle_soup(ph::CLtriangle* tris, ph::CLtriangle* norms, size_t num_tris)
+void set_triangle_soup(ph::CLtriangle* tris, ph::CLpackedNormals* norms, size_t num_tris)
 {
     // If CL triangle soup doesn't exist, create
     static bool soup_exists = false;
@@ -170,32 +491,39 @@ void set_triangle_soup(ph::CLtriangle* tris, ph::CLtriangle* norms, size_t num_t
         }
     }
     soup_exists = true;
-    if (num_tris == 0)
+    // Scenes of analytic primitives have no triangles. The tracer then gets
+    // NULL buffers, which it never reads.
+    if (num_tris > 0)
     {
-        return;
-    }
-    m_cl_triangle_soup = clCreateBuffer(m_context,
-            CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-            sizeof(CLtriangle) * (size_t)num_tris, (void*)tris, &err);
-    if (err != CL_SUCCESS)
-    {
-        phatal_error("Could not create buffer for tri soup");
-    }
-    m_cl_normal_soup = clCreateBuffer(m_context,
-            CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-            sizeof(CLtriangle) * (size_t)num_tris, (void*)norms, &err);
-    if (err != CL_SUCCESS)
-    {
-        phatal_error("Could not create buffer for normal soup");
+        CLwoopTriangle* woop_tris = phalloc(CLwoopTriangle, num_tris);
+        for (size_t i = 0; i < num_tris; ++i)
+        {
+            woop_tris[i] = make_woop_triangle(tris[i]);
+        }
+        m_cl_triangle_soup = clCreateBuffer(m_context,
+                CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                sizeof(CLwoopTriangle) * (size_t)num_tris, (void*)woop_tris, &err);
+        phree(woop_tris);
+        if (err != CL_SUCCESS)
+        {
+            phatal_error("Could not create buffer for tri soup");
+        }
+        m_cl_normal_soup = clCreateBuffer(m_context,
+                CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                sizeof(CLpackedNormals) * (size_t)num_tris, (void*)norms, &err);
+        if (err != CL_SUCCESS)
+        {
+            phatal_error("Could not create buffer for normal soup");
+        }
     }
 
     // Set arguments.
     err = clSetKernelArg(m_cl_kernel,
-            8, sizeof(cl_mem), (void*)&m_cl_triangle_soup);
+            Arg_Tris, sizeof(cl_mem), (void*)&m_cl_triangle_soup);
     if (err != CL_SUCCESS) { phatal_error("Can't set kernel arg (tri soup)"); }
 
     err = clSetKernelArg(m_cl_kernel,
-            9, sizeof(cl_mem), (void*)&m_cl_normal_soup);
+            Arg_Norms, sizeof(cl_mem), (void*)&m_cl_normal_soup);
     if (err != CL_SUCCESS) { phatal_error("Can't set kernel arg (normal soup)"); }
 }
 
@@ -204,110 +532,648 @@ void toggle_timewarp()
     m_tw_enabled = !m_tw_enabled;
 }
 
+static float event_ms(cl_event event, cl_profiling_info begin, cl_profiling_info end)
+{
+    cl_ulong t0 = 0;
+    cl_ulong t1 = 0;
+    if (!event)
+    {
+        return 0;
+    }
+    clGetEventProfilingInfo(event, begin, sizeof(cl_ulong), &t0, NULL);
+    clGetEventProfilingInfo(event, end, sizeof(cl_ulong), &t1, NULL);
+    return float(t1 - t0) / 1000000.0f;
+}
+
+static void release_pending(PendingFrame* frame)
+{
+    for (int i = 0; i < Pass_Count; ++i)
+    {
+        if (frame->events[i])
+        {
+            clReleaseEvent(frame->events[i]);
+            frame->events[i] = NULL;
+        }
+    }
+    frame->in_use = false;
+}
+
+// Read back every pending frame that has finished on the device.
+static void collect_frame_stats()
+{
+    for (int f = 0; f < kMaxPendingFrames; ++f)
+    {
+        PendingFrame* frame = &m_pending_frames[f];
+        if (!frame->in_use)
+        {
+            continue;
+        }
+        // Commands complete in order, so the release is the last one.
+        cl_int status = CL_QUEUED;
+        clGetEventInfo(frame->events[Pass_Release], CL_EVENT_COMMAND_EXECUTION_STATUS,
+                sizeof(cl_int), &status, NULL);
+        if (status != CL_COMPLETE)
+        {
+            continue;
+        }
+        cl_ulong acquire_queued = 0;
+        cl_ulong acquire_start  = 0;
+        cl_ulong release_end    = 0;
+        clGetEventProfilingInfo(frame->events[Pass_Acquire], CL_PROFILING_COMMAND_QUEUED,
+                sizeof(cl_ulong), &acquire_queued, NULL);
+        clGetEventProfilingInfo(frame->events[Pass_Acquire], CL_PROFILING_COMMAND_START,
+                sizeof(cl_ulong), &acquire_start, NULL);
+        clGetEventProfilingInfo(frame->events[Pass_Release], CL_PROFILING_COMMAND_END,
+                sizeof(cl_ulong), &release_end, NULL);
+
+        FrameStats stats;
+        stats.acquire_ms  = event_ms(frame->events[Pass_Acquire],
+                CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END);
+        stats.trace_ms    = event_ms(frame->events[Pass_Trace],
+                CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END) +
+                event_ms(frame->events[Pass_TraceRightEye],
+                CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END);
+        stats.reconstruct_ms = event_ms(frame->events[Pass_Reconstruct],
+                CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END);
+        stats.release_ms  = event_ms(frame->events[Pass_Release],
+                CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END);
+        stats.device_ms   = float(release_end - acquire_start) / 1000000.0f;
+        stats.queue_ms    = float(acquire_start - acquire_queued) / 1000000.0f;
+        stats.host_ms     = frame->host_ms;
+        stats.rays_traced = frame->rays_traced;
+
+        m_last_stats = stats;
+        m_sum_stats.acquire_ms  += stats.acquire_ms;
+        m_sum_stats.trace_ms    += stats.trace_ms;
+        m_sum_stats.reconstruct_ms += stats.reconstruct_ms;
+        m_sum_stats.release_ms  += stats.release_ms;
+        m_sum_stats.device_ms   += stats.device_ms;
+        m_sum_stats.queue_ms    += stats.queue_ms;
+        m_sum_stats.host_ms     += stats.host_ms;
+        m_sum_rays += stats.rays_traced;
+        m_num_stats++;
+
+        release_pending(frame);
+    }
+}
+
+const FrameStats get_frame_stats()
+{
+    return m_last_stats;
+}
+
+void get_last_eyes(vr::Eye* eyes)
+{
+    eyes[vr::EYE_Left] = m_prev_eyes[vr::EYE_Left];
+    eyes[vr::EYE_Right] = m_prev_eyes[vr::EYE_Right];
+}
+
+// Smallest (lens centered, aspect corrected) rsq over a rectangle of pixels.
+// Same mapping as ray_table in tracer.cl. rsq is convex, so the minimum is at
+// the point of the rectangle closest to the lens center.
+static float min_rsq(int eye, int x0, int y0, int w, int h)
+{
+    const float size_px[2] = { (float)(width / 2), (float)height };
+    const float ar = size_px[1] / size_px[0];
+    float cx = m_hmd_consts.lens_centers[eye][0] / m_hmd_consts.viewport_size_m[0];
+    float cy = m_hmd_consts.lens_centers[eye][1] / m_hmd_consts.viewport_size_m[1];
+    float u0 = (float)x0 / size_px[0] - cx;
+    float u1 = (float)(x0 + w - 1) / size_px[0] - cx;
+    float v0 = (float)y0 / size_px[1] - cy;
+    float v1 = (float)(y0 + h - 1) / size_px[1] - cy;
+    float u = fminf(fmaxf(0.0f, u0), u1);
+    float v = fminf(fmaxf(0.0f, v0), v1) * ar;
+    return u * u + v * v;
+}
+
+// min_rsq for one eye, or for the closer of both eyes when stereo.
+static float tile_rsq(bool stereo, int eye, int x0, int y0, int w, int h)
+{
+    float rsq = min_rsq(eye, x0, y0, w, h);
+    if (stereo)
+    {
+        rsq = fminf(rsq, min_rsq(vr::EYE_Right, x0, y0, w, h));
+    }
+    return rsq;
+}
+
+// Build the tile list for main() in tracer.cl (encoding is described there).
+// Only tiles that touch the lens circle are listed, alternating between eyes.
+// When foveated, each block gets a shading level from the rsq of its most
+// central pixel, written to `block_levels` (-1 for blocks outside the lens).
+// Stereo tiles are all left eye tiles, listed if they touch either lens circle.
+// Returns the number of tiles. Caller frees *out_tiles.
+static int build_tiles(int shading, int** out_tiles, int* block_levels)
+{
+    const bool foveated = (shading == Shading_Foveated);
+    const bool stereo = (shading == Shading_Stereo);
+    const int size_px[2] = { width / 2, height };
+    const int block_w = 2 * kTileWidth;
+    const int block_h = 2 * kTileHeight;
+    const int blocks_x = size_px[0] / block_w;
+    const int blocks_y = size_px[1] / block_h;
+    const int max_tiles_per_eye = (size_px[0] / kTileWidth) * (size_px[1] / kTileHeight);
+
+    int* eye_tiles[2];
+    int num_eye_tiles[2] = {};
+    int num_rays = 0;
+    for (int eye = 0; eye < vr::EYE_Count; ++eye)
+    {
+        eye_tiles[eye] = phalloc(int, max_tiles_per_eye);
+        if (stereo && eye == vr::EYE_Right)
+        {
+            continue;
+        }
+        for (int by = 0; by < blocks_y; ++by)
+        {
+            for (int bx = 0; bx < blocks_x; ++bx)
+            {
+                int x0 = bx * block_w;
+                int y0 = by * block_h;
+                float block_rsq = tile_rsq(stereo, eye, x0, y0, block_w, block_h);
+                int level = -1;
+                if (block_rsq < kLensRadiusSq)
+                {
+                    level = 0;
+                    if (foveated)
+                    {
+                        level = (block_rsq < m_fovea_full_rsq) ? 0 :
+                                (block_rsq < m_fovea_half_rsq) ? 1 : 2;
+                    }
+                }
+                if (block_levels)
+                {
+                    block_levels[(eye * blocks_y + by) * blocks_x + bx] = level;
+                }
+                if (level < 0)
+                {
+                    continue;
+                }
+                // Split the block into tiles of its level, dropping those that miss the lens.
+                int tile_w = kTileWidth << (level > 0 ? 1 : 0);
+                int tile_h = kTileHeight << (level > 1 ? 1 : 0);
+                for (int ty = y0; ty < y0 + block_h; ty += tile_h)
+                {
+                    for (int tx = x0; tx < x0 + block_w; tx += tile_w)
+                    {
+                        if (tile_rsq(stereo, eye, tx, ty, tile_w, tile_h) < kLensRadiusSq)
+                        {
+                            eye_tiles[eye][num_eye_tiles[eye]++] =
+                                (ty << 13) | (tx << 3) | (level << 1) | eye;
+                            num_rays += kTileWidth * kTileHeight * (stereo ? 2 : 1);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    int num_tiles = num_eye_tiles[vr::EYE_Left] + num_eye_tiles[vr::EYE_Right];
+    int* tiles = phalloc(int, num_tiles);
+    int n = 0;
+    for (int i = 0; n < num_tiles; ++i)
+    {
+        for (int eye = 0; eye < vr::EYE_Count; ++eye)
+        {
+            if (i < num_eye_tiles[eye])
+            {
+                tiles[n++] = eye_tiles[eye][i];
+            }
+        }
+    }
+    phree(eye_tiles[vr::EYE_Left]);
+    phree(eye_tiles[vr::EYE_Right]);
+
+    logf("%s tiles: %d, rays per frame: %d of %d\n",
+            foveated ? "Foveated" : stereo ? "Stereo" : "Full rate",
+            num_tiles, num_rays, width * height);
+    *out_tiles = tiles;
+    return num_tiles;
+}
+
+// (Re)create the tile lists and the block level map.
+static void build_tile_buffers()
+{
+    cl_int err = CL_SUCCESS;
+    const int num_blocks = width * height / (4 * kTileWidth * kTileHeight);
+    int* block_levels = phalloc(int, num_blocks);
+    for (int i = 0; i < Shading_Count; ++i)
+    {
+        if (m_cl_tiles[i])
+        {
+            // Frames in flight keep their own reference.
+            clReleaseMemObject(m_cl_tiles[i]);
+        }
+        int* tiles = NULL;
+        m_num_tiles[i] = build_tiles(i, &tiles,
+                (i == Shading_Foveated) ? block_levels : NULL);
+        m_cl_tiles[i] = clCreateBuffer(m_context,
+                CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, m_num_tiles[i] * sizeof(int), (void*)tiles, &err);
+        if (err != CL_SUCCESS)
+        {
+            phatal_error("Can't create tile list CL buffer");
+        }
+
+        int* eye_tiles = phalloc(int, m_num_tiles[i]);
+        for (int eye = 0; eye < vr::EYE_Count; ++eye)
+        {
+            if (m_cl_eye_tiles[i][eye])
+            {
+                clReleaseMemObject(m_cl_eye_tiles[i][eye]);
+                m_cl_eye_tiles[i][eye] = NULL;
+            }
+            int n = 0;
+            for (int t = 0; t < m_num_tiles[i]; ++t)
+            {
+                if ((tiles[t] & 1) == eye)
+                {
+                    eye_tiles[n++] = tiles[t];
+                }
+            }
+            m_num_eye_tiles[i][eye] = n;
+            if (n > 0)
+            {
+                m_cl_eye_tiles[i][eye] = clCreateBuffer(m_context,
+                        CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, n * sizeof(int), (void*)eye_tiles, &err);
+                if (err != CL_SUCCESS)
+                {
+                    phatal_error("Can't create eye tile list CL buffer");
+                }
+            }
+        }
+        phree(eye_tiles);
+        phree(tiles);
+    }
+    if (m_cl_block_levels)
+    {
+        clReleaseMemObject(m_cl_block_levels);
+    }
+    m_cl_block_levels = clCreateBuffer(m_context,
+            CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, num_blocks * sizeof(int), (void*)block_levels, &err);
+    phree(block_levels);
+    if (err != CL_SUCCESS)
+    {
+        phatal_error("Can't create block level CL buffer");
+    }
+    err = clSetKernelArg(m_cl_reconstruct_kernel,
+            Reconstruct_BlockLevels, sizeof(cl_mem), (void*)&m_cl_block_levels);
+    if (err != CL_SUCCESS)
+    {
+        phatal_error("Can't set reconstruct kernel arg (block levels)");
+    }
+}
+
+void set_foveation_profile(float full_rsq, float half_rsq)
+{
+    // The rate only drops away from the center.
+    if (full_rsq > half_rsq)
+    {
+        phatal_error("Foveation profile needs full_rsq <= half_rsq");
+    }
+    m_fovea_full_rsq = full_rsq;
+    m_fovea_half_rsq = half_rsq;
+    if (m_context)
+    {
+        build_tile_buffers();
+    }
+}
+
+// Foveated frames leave the caches of skipped texels as they were, and cached
+// colors were shaded with the old settings, so the toggles below drop the cache.
+void toggle_foveation()
+{
+    m_foveated = !m_foveated;
+    m_cache_dirty = true;
+}
+
+void toggle_temporal()
+{
+    m_temporal = !m_temporal;
+    if (m_temporal)
+    {
+        m_cache_dirty = true;
+    }
+}
+
+void toggle_stereo_traversal()
+{
+    m_stereo = !m_stereo;
+}
+
+void toggle_stereo_reuse()
+{
+    m_stereo_reuse = !m_stereo_reuse;
+    if (m_stereo_reuse)
+    {
+        m_cache_dirty = true;
+    }
+}
+
+void toggle_stackless_traversal()
+{
+    m_stackless = !m_stackless;
+}
+
+void toggle_shadows()
+{
+    m_shadows = !m_shadows;
+    m_cache_dirty = true;
+}
+
+// Fill m_cl_ray_table with the ray_table kernel. Needs to run again only if the
+// HMD constants or the resolution change.
+static void build_ray_table(cl_mem cl_K)
+{
+    cl_int err = CL_SUCCESS;
+    cl_kernel kernel = clCreateKernel(m_cl_program, "ray_table", &err);
+    if (err != CL_SUCCESS)
+    {
+        phatal_error("Can't get ray_table kernel from program.");
+    }
+    m_cl_ray_table = clCreateBuffer(m_context,
+            CL_MEM_READ_WRITE, width * height * 4 * sizeof(float), NULL, &err);
+    if (err != CL_SUCCESS)
+    {
+        phatal_error("Can't create ray table CL buffer");
+    }
+    int size_px[2] = { width / 2, height };
+    err = clSetKernelArg(kernel, 0, sizeof(cl_mem), (void*)&m_cl_ray_table);
+    err |= clSetKernelArg(kernel, 1, 2 * sizeof(float), (void*)m_hmd_consts.lens_centers[vr::EYE_Left]);
+    err |= clSetKernelArg(kernel, 2, 2 * sizeof(float), (void*)m_hmd_consts.lens_centers[vr::EYE_Right]);
+    err |= clSetKernelArg(kernel, 3, sizeof(float), (void*)&m_hmd_consts.eye_to_screen);
+    err |= clSetKernelArg(kernel, 4, 2 * sizeof(float), (void*)m_hmd_consts.viewport_size_m);
+    err |= clSetKernelArg(kernel, 5, 2 * sizeof(int), (void*)size_px);
+    err |= clSetKernelArg(kernel, 6, sizeof(cl_mem), (void*)&cl_K);
+    if (err != CL_SUCCESS)
+    {
+        phatal_error("Can't set ray_table kernel arguments");
+    }
+    size_t global_size[2] = { width, height };
+    err = clEnqueueNDRangeKernel(m_queue, kernel, 2, NULL, global_size, NULL, 0, NULL, NULL);
+    if (err != CL_SUCCESS)
+    {
+        phatal_error("Error enqueuing ray_table kernel");
+    }
+    clFinish(m_queue);
+    clReleaseKernel(kernel);
+}
+
 void draw()
 {
-    //auto t_start = io::get_microseconds();
+    PH_PROFILE_SCOPE("draw");
 
     cl_int err;
 
-    err = clEnqueueAcquireGLObjects(
-            m_queue, 1, &m_cl_texture, 0, NULL/*event wait list*/, NULL/*event*/);
-    if (err != CL_SUCCESS)
+    int64 frame_index = m_frame_counter++;
+
+    collect_frame_stats();
+    PendingFrame* frame = &m_pending_frames[frame_index % kMaxPendingFrames];
+    if (frame->in_use)
     {
-        phatal_error("Could not acquire texture from GL context");
+        // Device is more than kMaxPendingFrames behind. Drop that sample rather than wait.
+        release_pending(frame);
     }
 
-    cl_event event;  // TODO; I don't think I'm gonna need this...
+    RenderSlot* slot = &m_slots[frame_index % kNumRenderTargets];
+    // Show the previous frame. On the very first frame there is none, so show this one.
+    RenderSlot* present = (frame_index > 0) ?
+        &m_slots[(frame_index - 1) % kNumRenderTargets] : slot;
 
     auto t_send = io::get_microseconds();
 
-    size_t global_size[2] =
+    // Don't overwrite the slot while GL may still be sampling it.
+    cl_event gl_done_event = NULL;
+    if (slot->gl_done)
     {
-        width/2,
-        height,
-    };
+        if (m_create_event_from_gl_sync)
+        {
+            gl_done_event = m_create_event_from_gl_sync(m_context, (cl_GLsync)slot->gl_done, &err);
+            if (err != CL_SUCCESS)
+            {
+                gl_done_event = NULL;
+            }
+        }
+        if (!gl_done_event)
+        {
+            // Fenced a frame ago; normally signaled already.
+            glClientWaitSync(slot->gl_done, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        }
+    }
+
+    err = clEnqueueAcquireGLObjects(
+            m_queue, 1, &slot->cl_texture,
+            gl_done_event ? 1 : 0, gl_done_event ? &gl_done_event : NULL,
+            &frame->events[Pass_Acquire]);
+    if (err != CL_SUCCESS)
+    {
+        phatal_error("Could not acquire texture from GL context");
+    }
+    if (gl_done_event)
+    {
+        clReleaseEvent(gl_done_event);
+    }
 
     size_t local_size[2] =
     {
-        16,
-        4,
+        kTileWidth,
+        kTileHeight,
     };
 
-    vr::FrameInfo frameinfo = {};
-    vr::RenderEyePose eye_pose = vr::begin_frame(&frameinfo);
-
-    vr::Eye left = frameinfo.left;
-    vr::Eye right = frameinfo.right;
+    size_t global_size[2] =
+    {
+        m_num_work_groups * local_size[0],
+        local_size[1],
+    };
 
-    // Kernel arguments that change every frame.
-    cl_int off = 0;
-    err = clSetKernelArg(m_cl_kernel,
-            1, sizeof(cl_int), (void*) &off);
-    err |= clSetKernelArg(m_cl_kernel,
-            2, 2 * sizeof(float), (void*)&m_hmd_consts.lens_centers[vr::EYE_Left]);
-    err |= clSetKernelArg(m_cl_kernel,
-            6, sizeof(vr::Eye), (void*)&left);
-    if (err != CL_SUCCESS)
+    vr::FrameInfo frameinfo = {};
+    slot->eye_pose = vr::begin_frame(&frameinfo);
+
+    // Per-frame parameters, both eyes at once.
+    slot->params = m_base_params;
+    slot->params.eyes[vr::EYE_Left] = frameinfo.left;
+    slot->params.eyes[vr::EYE_Right] = frameinfo.right;
+    slot->params.prev_eyes[vr::EYE_Left] = (frame_index > 0) ? m_prev_eyes[vr::EYE_Left] : frameinfo.left;
+    slot->params.prev_eyes[vr::EYE_Right] = (frame_index > 0) ? m_prev_eyes[vr::EYE_Right] : frameinfo.right;
+    const bool foveated = m_foveated && !m_stereo;
+    slot->params.foveated = foveated;
+    slot->params.temporal = m_temporal;
+    slot->params.frame_index = (int)frame_index;
+    slot->params.stereo = m_stereo;
+    const bool stereo_reuse = m_stereo_reuse && !m_stereo;
+    slot->params.stereo_reuse = stereo_reuse;
+    slot->params.stackless = m_stackless || m_bvh_depth > kTraceStackSize;
+    slot->params.shadows = m_shadows;
+    slot->params.voxel_grid = m_voxel_grid;
+    m_prev_eyes[vr::EYE_Left] = frameinfo.left;
+    m_prev_eyes[vr::EYE_Right] = frameinfo.right;
+    const int shading = m_stereo ? Shading_Stereo : foveated ? Shading_Foveated : Shading_Full;
+    // Cache written this frame, and the one written last frame.
+    const int cache_out = (int)(frame_index & 1);
+    const int cache_in = cache_out ^ 1;
+
+    // Submission only; the device runs while we present the previous frame.
+    PH_PROFILE_BEGIN(trace);
+
+    if (m_cache_dirty)
     {
-        phatal_error("Error setting kernel argument (left eye)");
+        size_t num_pixels = width * height;
+        for (int i = 0; i < 2; ++i)
+        {
+            err = clSetKernelArg(m_cl_invalidate_kernel, 0, sizeof(cl_mem), (void*)&m_cl_cache_hit[i]);
+            err |= clEnqueueNDRangeKernel(m_queue, m_cl_invalidate_kernel, 1, NULL,
+                    &num_pixels, NULL, 0, NULL, NULL);
+            if (err != CL_SUCCESS)
+            {
+                phatal_error("Error invalidating pixel cache");
+            }
+        }
+        m_cache_dirty = false;
     }
 
-    // Left eye
-    err = clEnqueueNDRangeKernel(
-            m_queue,
-            m_cl_kernel,
-            2, //dim
-            NULL, // offset
-            global_size,
-            local_size,
-            0, NULL, &event);
+    static const cl_int zeros[2] = {};
+    err = clEnqueueWriteBuffer(m_queue, m_cl_frame_params, CL_FALSE, 0,
+            sizeof(FrameParams), &slot->params, 0, NULL, NULL);
+    err |= clEnqueueWriteBuffer(m_queue, m_cl_counters, CL_FALSE, 0,
+            sizeof(zeros), zeros, 0, NULL, NULL);
     if (err != CL_SUCCESS)
     {
-        phatal_error("Error enqueuing kernel (left)");
+        phatal_error("Error writing per-frame buffers");
     }
 
-    // Update parameters for right eye
-    off = width / 2;
     err = clSetKernelArg(m_cl_kernel,
-            1, sizeof(cl_int), (void*) &off);
+            Arg_Image, sizeof(cl_mem), (void*) &slot->cl_texture);
+    err |= clSetKernelArg(m_cl_kernel,
+            Arg_CacheColor, sizeof(cl_mem), (void*) &m_cl_cache_color[cache_out]);
+    err |= clSetKernelArg(m_cl_kernel,
+            Arg_CacheHit, sizeof(cl_mem), (void*) &m_cl_cache_hit[cache_out]);
+    err |= clSetKernelArg(m_cl_kernel,
+            Arg_CacheTri, sizeof(cl_mem), (void*) &m_cl_cache_tri[cache_out]);
+    err |= clSetKernelArg(m_cl_kernel,
+            Arg_PrevColor, sizeof(cl_mem), (void*) &m_cl_cache_color[cache_in]);
     err |= clSetKernelArg(m_cl_kernel,
-            2, 2 * sizeof(float), (void*)&m_hmd_consts.lens_centers[vr::EYE_Right]);
+            Arg_PrevHit, sizeof(cl_mem), (void*) &m_cl_cache_hit[cache_in]);
     err |= clSetKernelArg(m_cl_kernel,
-            6, sizeof(vr::Eye), (void*)&right);
+            Arg_PrevTri, sizeof(cl_mem), (void*) &m_cl_cache_tri[cache_in]);
     if (err != CL_SUCCESS)
     {
-        phatal_error("Error setting kernel argument (right eye)");
+        phatal_error("Error setting kernel arguments (per frame)");
     }
 
-    err = clEnqueueNDRangeKernel(
-            m_queue,
-            m_cl_kernel,
-            2, //dim
-            NULL, // offset
-            global_size,
-            local_size,
-            0, NULL, &event);
+    // One launch over both eyes' tiles. For stereo reuse, the left eye's tiles
+    // and then the right eye's, which reprojects the left eye where it can.
+    const int num_launches = stereo_reuse ? 2 : 1;
+    for (int launch = 0; launch < num_launches; ++launch)
+    {
+        cl_mem* tiles = &m_cl_tiles[shading];
+        int* num_tiles = &m_num_tiles[shading];
+        if (stereo_reuse)
+        {
+            tiles = &m_cl_eye_tiles[shading][launch];
+            num_tiles = &m_num_eye_tiles[shading][launch];
+            if (*num_tiles == 0)
+            {
+                continue;
+            }
+        }
+        if (launch > 0)
+        {
+            // Restart the tile queue. The ray count carries over.
+            err = clEnqueueWriteBuffer(m_queue, m_cl_counters, CL_FALSE, 0,
+                    sizeof(cl_int), zeros, 0, NULL, NULL);
+            if (err != CL_SUCCESS)
+            {
+                phatal_error("Error resetting tile counter");
+            }
+        }
+        err = clSetKernelArg(m_cl_kernel,
+                Arg_Tiles, sizeof(cl_mem), (void*) tiles);
+        err |= clSetKernelArg(m_cl_kernel,
+                Arg_NumTiles, sizeof(cl_int), (void*) num_tiles);
+        err |= clEnqueueNDRangeKernel(
+                m_queue,
+                m_cl_kernel,
+                2, //dim
+                NULL, // offset
+                global_size,
+                local_size,
+                0, NULL, &frame->events[launch ? Pass_TraceRightEye : Pass_Trace]);
+        if (err != CL_SUCCESS)
+        {
+            phatal_error("Error enqueuing kernel");
+        }
+    }
+    err = clEnqueueReadBuffer(m_queue, m_cl_counters, CL_FALSE, sizeof(cl_int), sizeof(cl_int),
+            &frame->rays_traced, 0, NULL, NULL);
     if (err != CL_SUCCESS)
     {
-        phatal_error("Error enqueuing kernel (right)");
+        phatal_error("Error reading ray counter");
     }
 
-    // Wait and release
-    clFinish(m_queue);
+    if (foveated)
+    {
+        // One work group per tile.
+        size_t reconstruct_size[2] =
+        {
+            m_num_tiles[Shading_Foveated] * local_size[0],
+            local_size[1],
+        };
+        err = clSetKernelArg(m_cl_reconstruct_kernel,
+                Reconstruct_Image, sizeof(cl_mem), (void*) &slot->cl_texture);
+        err |= clSetKernelArg(m_cl_reconstruct_kernel,
+                Reconstruct_ColorBuffer, sizeof(cl_mem), (void*) &m_cl_cache_color[cache_out]);
+        err |= clSetKernelArg(m_cl_reconstruct_kernel,
+                Reconstruct_Tiles, sizeof(cl_mem), (void*) &m_cl_tiles[Shading_Foveated]);
+        err |= clEnqueueNDRangeKernel(
+                m_queue,
+                m_cl_reconstruct_kernel,
+                2,
+                NULL,
+                reconstruct_size,
+                local_size,
+                0, NULL, &frame->events[Pass_Reconstruct]);
+        if (err != CL_SUCCESS)
+        {
+            phatal_error("Error enqueuing reconstruct kernel");
+        }
+    }
 
     err = clEnqueueReleaseGLObjects(
             m_queue,
             1,
-            &m_cl_texture,
-            0, NULL, NULL);
+            &slot->cl_texture,
+            0, NULL, &frame->events[Pass_Release]);
     if (err != CL_SUCCESS)
     {
         phatal_error("could not release texture");
     }
+    // The slot holds its own reference; the stats ring releases the other one.
+    slot->cl_done = frame->events[Pass_Release];
+    clRetainEvent(slot->cl_done);
+    clFlush(m_queue);
+    PH_PROFILE_END(trace, "trace");
 
     auto t_draw = io::get_microseconds();
+    frame->host_ms = float(t_draw - t_send) / 1000.0f;
+    frame->in_use = true;
+
+    // Wait for the frame we are about to show. Returns immediately unless the
+    // device is a whole frame behind.
+    {
+        PH_PROFILE_SCOPE("wait_present");
+        clWaitForEvents(1, &present->cl_done);
+        clReleaseEvent(present->cl_done);
+        present->cl_done = NULL;
+        if (present->gl_done)
+        {
+            // Superseded by the fence placed below. If CL traced into the slot it
+            // already waited on this one.
+            glDeleteSync(present->gl_done);
+            present->gl_done = 0;
+        }
+    }
 
-    vr::end_frame(&eye_pose, &frameinfo);
+    // Timewarp from the pose the presented frame was traced with.
+    vr::end_frame(&present->eye_pose, &frameinfo);
 
     // 0.5 lerp.
     // TODO: don't draw a single quad. Draw a grid and use different "timewarp factors".
@@ -326,6 +1192,7 @@ void draw()
     }
 
     // Bind rendertarget
+    PH_PROFILE_BEGIN(timewarp_pass);
     glBindFramebuffer(GL_FRAMEBUFFER, g_rendertarget.fbo);
     glBindRenderbuffer(GL_RENDERBUFFER, g_rendertarget.depth);
     // Draw texture to rendertarget
@@ -340,7 +1207,7 @@ void draw()
         &timewarp_r
     };
     glActiveTexture (GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, m_gl_texture);
+    glBindTexture(GL_TEXTURE_2D, present->gl_texture);
     glUseProgram(m_quad_program);
     GLfloat transposed [4][4];
     for (int i = 0; i < 2; ++i)
@@ -362,9 +1229,14 @@ void draw()
     }
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
     GLCHK (glBindRenderbuffer(GL_RENDERBUFFER, 0));
+    // Last GL read of the slot. CL waits on this before tracing into it again.
+    present->gl_done = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush();
+    PH_PROFILE_END(timewarp_pass, "timewarp_pass");
 
     // Draw texture to screen
     {
+        PH_PROFILE_SCOPE("postproc_pass");
         // ++++
         // TODO: pass matrix to quad program & rotate...
         // ++++
@@ -378,20 +1250,13 @@ void draw()
         GLCHK (glDrawArrays (GL_TRIANGLE_FAN, 0, 4) );
     }
 
-    //auto t_end = io::get_microseconds();
-
-#if 0
-    logf("Total frame time: %f\nOpenCL time: %f\nDraw time: %f\n=====================\n",
-            float(t_end - t_start) / 1000.0f,
-            float(t_draw - t_send) / 1000.0f,
-            float(t_end - t_draw) / 1000.0f
-        );
-#endif
-
     m_avg_render += float(t_draw - t_send) / 1000.0f;
     m_num_frames++;
 
-    window::swap_buffers();
+    {
+        PH_PROFILE_SCOPE("swap_buffers");
+        window::swap_buffers();
+    }
 }
 
 void init()
@@ -527,7 +1392,7 @@ void init()
     // Command queue
     // ========================================
 
-    m_queue = clCreateCommandQueue(m_context, device, 0, &err);
+    m_queue = clCreateCommandQueue(m_context, device, CL_QUEUE_PROFILING_ENABLE, &err);
     if (err != CL_SUCCESS)
     {
         logf("err num %d\n", err);
@@ -540,12 +1405,15 @@ void init()
 
     m_hmd_consts = vr::get_hmd_constants();
 
-    // Create ray tracing target
+    // Create ray tracing targets
+    float* black = phalloc(float, width * height * 4);
+    memset(black, 0, width * height * 4 * sizeof(float));
+    for (int i = 0; i < kNumRenderTargets; ++i)
     {
         GLCHK (glActiveTexture (GL_TEXTURE0) );
         // Create texture
-        glGenTextures   (1, &m_gl_texture);
-        glBindTexture   (GL_TEXTURE_2D, m_gl_texture);
+        glGenTextures   (1, &m_slots[i].gl_texture);
+        glBindTexture   (GL_TEXTURE_2D, m_slots[i].gl_texture);
 
         // Note for the future: These are needed.
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
@@ -553,9 +1421,28 @@ void init()
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
 
-        // Pass a null pointer, texture will be filled by opencl ray tracer
+        // The ray tracer only writes tiles inside the lens circle. Start from black so
+        // the rest never needs clearing.
         GLCHK ( glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height,
-                    0, GL_RGBA, GL_FLOAT, NULL) );
+                    0, GL_RGBA, GL_FLOAT, black) );
+    }
+    phree(black);
+    // CL/GL textures have to be complete before CL can share them.
+    glFinish();
+
+    // cl_khr_gl_event lets the device wait for GL fences instead of the host.
+    {
+        size_t sz = 0;
+        clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, 0, NULL, &sz);
+        char* extensions = phalloc(char, sz);
+        clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, sz, (void*)extensions, NULL);
+        if (strstr(extensions, "cl_khr_gl_event"))
+        {
+            m_create_event_from_gl_sync =
+                (CreateEventFromGLsyncFn)clGetExtensionFunctionAddress("clCreateEventFromGLsyncKHR");
+        }
+        phree(extensions);
+        logf("GL sync on device: %s\n", m_create_event_from_gl_sync ? "yes" : "no (host waits)");
     }
 
     // Create renderbuffer, on which we do post-processing.
@@ -710,15 +1597,16 @@ void init()
         }
     }
 
-    // Create OpenCL buffer
+    // Create OpenCL images
+    for (int i = 0; i < kNumRenderTargets; ++i)
     {
         cl_mem_flags flags = CL_MEM_WRITE_ONLY;
-        m_cl_texture = clCreateFromGLTexture2D(
+        m_slots[i].cl_texture = clCreateFromGLTexture2D(
                 m_context,
                 flags,
                 /*texture_target*/GL_TEXTURE_2D,
                 /*miplevel*/0,
-                m_gl_texture,
+                m_slots[i].gl_texture,
                 &err);
         if (err != CL_SUCCESS)
         {
@@ -793,6 +1681,16 @@ void init()
         {
             phatal_error("Can't get kernel from program.");
         }
+        m_cl_reconstruct_kernel = clCreateKernel(m_cl_program, "reconstruct", &err);
+        if (err != CL_SUCCESS)
+        {
+            phatal_error("Can't get reconstruct kernel from program.");
+        }
+        m_cl_invalidate_kernel = clCreateKernel(m_cl_program, "invalidate_cache", &err);
+        if (err != CL_SUCCESS)
+        {
+            phatal_error("Can't get invalidate_cache kernel from program.");
+        }
         // Set argument to be the texture.
         if (err != CL_SUCCESS)
         {
@@ -836,19 +1734,77 @@ void init()
         }
     }
 
+    build_ray_table(cl_K);
+    clReleaseMemObject(cl_K);
+
+    memcpy(m_base_params.lens_centers, m_hmd_consts.lens_centers, sizeof(m_base_params.lens_centers));
+    memcpy(m_base_params.viewport_size_m, m_hmd_consts.viewport_size_m, sizeof(m_base_params.viewport_size_m));
+    m_base_params.eye_to_screen = m_hmd_consts.eye_to_screen;
+    memcpy(m_base_params.K, K, sizeof(m_base_params.K));
+
+
+    // Per-frame buffers
+    {
+        m_cl_frame_params = clCreateBuffer(m_context,
+                CL_MEM_READ_ONLY, sizeof(FrameParams), NULL, &err);
+        if (err != CL_SUCCESS)
+        {
+            phatal_error("Can't create frame params CL buffer");
+        }
+        m_cl_counters = clCreateBuffer(m_context,
+                CL_MEM_READ_WRITE, 2 * sizeof(cl_int), NULL, &err);
+        if (err != CL_SUCCESS)
+        {
+            phatal_error("Can't create counters CL buffer");
+        }
+        for (int i = 0; i < 2; ++i)
+        {
+            // Each call overwrites err, so check every one.
+            cl_mem* caches[] = { &m_cl_cache_color[i], &m_cl_cache_hit[i], &m_cl_cache_tri[i] };
+            const size_t texel_sizes[] = { 4 * sizeof(float), 4 * sizeof(float), sizeof(cl_int) };
+            for (int k = 0; k < 3; ++k)
+            {
+                *caches[k] = clCreateBuffer(m_context,
+                        CL_MEM_READ_WRITE, width * height * texel_sizes[k], NULL, &err);
+                if (err != CL_SUCCESS)
+                {
+                    phatal_error("Can't create pixel cache CL buffers");
+                }
+            }
+        }
+    }
+
+    {
+        cl_uint compute_units = 1;
+        clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &compute_units, NULL);
+        m_num_work_groups = compute_units * kGroupsPerComputeUnit;
+        logf("Persistent work groups: %d\n", (int)m_num_work_groups);
+
+        // Keep the node cache small enough that every persistent group fits on its
+        // compute unit at once.
+        cl_ulong local_mem_size = 0;
+        clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &local_mem_size, NULL);
+        int64 budget = (int64)local_mem_size / kGroupsPerComputeUnit - kMainLocalBytes;
+        m_max_top_nodes = (int)(budget > 0 ? budget / (int64)sizeof(BVHNode) : 0);
+    }
 
     // Set arguments to the kernel that don't change per frame.
     err = clSetKernelArg(m_cl_kernel,
-            0, sizeof(cl_mem), (void*) &m_cl_texture);
-    err |= clSetKernelArg(m_cl_kernel,
-            3, sizeof(float), (void*)&m_hmd_consts.eye_to_screen);
-    err |= clSetKernelArg(m_cl_kernel,
-            4, 2 * sizeof(float), (void*)&m_hmd_consts.viewport_size_m);
+            Arg_FrameParams, sizeof(cl_mem), (void*)&m_cl_frame_params);
     int size_px[2] = { width / 2, height };
     err |= clSetKernelArg(m_cl_kernel,
-            5, 2 * sizeof(int), (void*)size_px);
+            Arg_ViewportSizePx, 2 * sizeof(int), (void*)size_px);
+    err |= clSetKernelArg(m_cl_kernel,
+            Arg_RayTable, sizeof(cl_mem), (void*)&m_cl_ray_table);
     err |= clSetKernelArg(m_cl_kernel,
-            7, sizeof(cl_mem), (void*)&cl_K);
+            Arg_Counters, sizeof(cl_mem), (void*)&m_cl_counters);
+
+    err |= clSetKernelArg(m_cl_reconstruct_kernel,
+            Reconstruct_ViewportSizePx, 2 * sizeof(int), (void*)size_px);
+    err |= clSetKernelArg(m_cl_reconstruct_kernel,
+            Reconstruct_RayTable, sizeof(cl_mem), (void*)&m_cl_ray_table);
+
+    build_tile_buffers();
     if (m_hmd_consts.meters_per_tan_angle != 0.036f)
     {
         logf("MetersPerTanAngleAtCenter is %f, expected 0.036\n", m_hmd_consts.meters_per_tan_angle);
@@ -880,13 +1836,76 @@ void init()
 
 void deinit()
 {
+    clFinish(m_queue);
+    collect_frame_stats();
+    for (int f = 0; f < kMaxPendingFrames; ++f)
+    {
+        if (m_pending_frames[f].in_use)
+        {
+            release_pending(&m_pending_frames[f]);
+        }
+    }
+    for (int i = 0; i < kNumRenderTargets; ++i)
+    {
+        RenderSlot* slot = &m_slots[i];
+        if (slot->cl_done)
+        {
+            clReleaseEvent(slot->cl_done);
+        }
+        if (slot->gl_done)
+        {
+            glDeleteSync(slot->gl_done);
+        }
+        clReleaseMemObject(slot->cl_texture);
+        glDeleteTextures(1, &slot->gl_texture);
+    }
+
+    clReleaseMemObject(m_cl_frame_params);
+    if (m_cl_top_nodes)
+    {
+        clReleaseMemObject(m_cl_top_nodes);
+    }
+    clReleaseMemObject(m_cl_counters);
+    for (int i = 0; i < Shading_Count; ++i)
+    {
+        clReleaseMemObject(m_cl_tiles[i]);
+        for (int eye = 0; eye < vr::EYE_Count; ++eye)
+        {
+            if (m_cl_eye_tiles[i][eye])
+            {
+                clReleaseMemObject(m_cl_eye_tiles[i][eye]);
+            }
+        }
+    }
+    clReleaseMemObject(m_cl_block_levels);
+    for (int i = 0; i < 2; ++i)
+    {
+        clReleaseMemObject(m_cl_cache_color[i]);
+        clReleaseMemObject(m_cl_cache_hit[i]);
+        clReleaseMemObject(m_cl_cache_tri[i]);
+    }
+    clReleaseKernel(m_cl_invalidate_kernel);
+    clReleaseKernel(m_cl_reconstruct_kernel);
+    clReleaseMemObject(m_cl_ray_table);
     clReleaseProgram(m_cl_program);
     clReleaseCommandQueue(m_queue);
     clReleaseContext(m_context);
 
     window::deinit();
 
-    logf("average opencl time is %f(%d)\n", m_avg_render / (float)m_num_frames, m_num_frames);
+    logf("average submit time is %f(%d)\n", m_avg_render / (float)m_num_frames, m_num_frames);
+    if (m_num_stats > 0)
+    {
+        float n = (float)m_num_stats;
+        logf("average device times (ms) over %" PRId64 " frames:\n"
+                "    acquire %f | trace %f | reconstruct %f | release %f\n"
+                "    device total %f | queue latency %f | host %f | rays %f\n",
+                m_num_stats,
+                m_sum_stats.acquire_ms / n, m_sum_stats.trace_ms / n,
+                m_sum_stats.reconstruct_ms / n, m_sum_stats.release_ms / n,
+                m_sum_stats.device_ms / n, m_sum_stats.queue_ms / n, m_sum_stats.host_ms / n,
+                (double)m_sum_rays / n);
+    }
 }
 
 }  // ns ocl
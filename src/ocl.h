@@ -3,21 +3,65 @@
 namespace ph
 {
 struct CLtriangle;
-struct Primitive;
+struct CLpackedNormals;
 struct BVHNode;
+struct CLvoxelGrid;
+namespace vr { struct Eye; }
 
 namespace ocl
 {
 
 static float            m_timewarp_factor;
 
+// Size of the render target: both eyes side by side. Other 16:9 sizes are listed in ocl.cc.
+static const int        kRenderTargetWidth = 1280;
+static const int        kRenderTargetHeight = 720;
+
+// Timings for one frame, in milliseconds. Device figures come from OpenCL
+// profiling events; host_ms is the wall time the host spent submitting the frame.
+struct FrameStats
+{
+    float acquire_ms;       // clEnqueueAcquireGLObjects on the device.
+    float trace_ms;         // Kernel execution, both eyes.
+    float reconstruct_ms;   // Filling texels skipped by foveation. 0 when off.
+    float release_ms;       // clEnqueueReleaseGLObjects on the device.
+    float device_ms;        // Start of acquire to end of release.
+    float queue_ms;         // Submission latency: acquire queued -> acquire started.
+    float host_ms;          // Host-side, from the acquire to the release being queued.
+    int   rays_traced;      // Primary rays actually traced (not reused or skipped).
+};
+
 void init();
 // Set triangle soup to be buffer.
-void set_triangle_soup(ph::CLtriangle* tris, ph::CLtriangle* norms, size_t num_tris);
-void set_primitive_array(ph::Primitive* prims, size_t num_prims);
+void set_triangle_soup(ph::CLtriangle* tris, ph::CLpackedNormals* norms, size_t num_tris);
 void set_flat_bvh(ph::BVHNode* tree, size_t num_nodes);
+// Trace `grid` instead of the BVH. NULL goes back to the BVH. See CLvoxelGrid.
+void set_voxel_grid(ph::CLvoxelGrid* grid, int* cells, size_t num_cells,
+        uint32_t* bricks, size_t num_brick_words);
 void toggle_timewarp();
+// Foveated ray rate. Every pixel is traced where rsq < full_rsq, every other
+// one up to half_rsq and one in four beyond. rsq is the squared distance from
+// the lens center in the ray tracer's units; the lens edge is at 0.25.
+// full_rsq must not be greater than half_rsq.
+void set_foveation_profile(float full_rsq, float half_rsq);
+void toggle_foveation();
+// Reuse last frame's hits for pixels whose reprojected hit still lies on their ray.
+void toggle_temporal();
+// Trace each pixel for both eyes with one BVH traversal. Full rate only.
+void toggle_stereo_traversal();
+// Trace the left eye first, then reuse its hits for right eye pixels that see
+// the same surface, away from depth edges. Off while stereo traversal is on.
+void toggle_stereo_reuse();
+// Trace without a traversal stack, skipping missed subtrees through escape
+// offsets. Always on for trees deeper than the stack.
+void toggle_stackless_traversal();
+// Shadow rays from every traced hit to the light, with an any-hit traversal.
+void toggle_shadows();
 void draw();
+// Stats of the most recent frame whose device timings have arrived.
+const FrameStats get_frame_stats();
+// Left and right eye of the most recent draw().
+void get_last_eyes(vr::Eye* eyes);
 void deinit();
 }
 }
@@ -6,15 +6,49 @@
 namespace ph
 {
 
+// Node references with this bit set index the copy of the top of the tree the
+// tracer keeps in local memory, see tracer.cl fetch_node. Global indices stay below it.
+static const int kLocalNodeBit = 1 << 28;
+// Inner nodes keep the axis their children were split on (0: x, 1: y, 2: z)
+// above the index in right_child_offset. The left child holds the lower side.
+static const int kSplitAxisShift = 29;
+// Leaves keep their PrimitiveType in the same bits.
+static const int kPrimTypeShift = kSplitAxisShift;
+
+enum PrimitiveType
+{
+    PrimitiveType_Triangles,
+    PrimitiveType_Box,          // Axis aligned. The bounding box of the leaf is the box.
+    PrimitiveType_Sphere,       // The sphere inscribed in the bounding box of the leaf.
+};
+
 // Plain and simple struct for flattened tree.
 struct BVHNode
 {
-    int primitive_offset;       // >0 when leaf. -1 when not.
-    int right_child_offset;     // Left child is adjacent to node. (-1 if leaf!)
+    int primitive_offset;       // >=0 when leaf. When not, -escape_offset: see below.
+    int right_child_offset;     // Left child is adjacent to node. (-1 if leaf!) Split axis on top.
+    // Uploaded leaves reference their triangles directly instead of a
+    // Primitive: primitive_offset is the first one and right_child_offset the
+    // count, with the PrimitiveType on top. Leaves of analytic primitives (a
+    // box, a sphere) are described by their bbox, and primitive_offset is the
+    // index of the leaf itself. See order_triangles_by_leaf() in scene.cc.
+    // The escape offset of a node is the index of the node that follows its
+    // subtree in depth first order (the tree size when there is none). Leaves
+    // don't store it; theirs is their own index + 1.
     AABB bbox;
     // 4 + 4 + (6 * 4 = 24) = 8 + 24 = 32 = (16 * 2) ... So it's 16 byte aligned
 };
 
+inline int get_right_child(BVHNode node)
+{
+    return node.right_child_offset & ((1 << kSplitAxisShift) - 1);
+}
+
+inline int get_split_axis(BVHNode node)
+{
+    return node.right_child_offset >> kSplitAxisShift;
+}
+
 struct CLvec3
 {
     float x;
@@ -32,13 +66,117 @@ struct CLtriangle
     CLvec3 _padding;
 };
 
+// The vertex normals of a triangle, octahedral encoded. Each one is the unit
+// normal projected onto the octahedron |x| + |y| + |z| = 1, its lower half
+// folded over the upper one, and the resulting (x, y) stored as two 16 bit
+// snorms, x in the low bits. See encode_normal().
+struct CLpackedNormals
+{
+    uint32_t n[3];
+};
+
+// Octahedral encoding of a unit normal. See CLpackedNormals.
+inline uint32_t encode_normal(CLvec3 n)
+{
+    float l1 = fabs(n.x) + fabs(n.y) + fabs(n.z);
+    float u = n.x / l1;
+    float v = n.y / l1;
+    if (n.z < 0)
+    {  // Fold the lower half over the upper one, across the diagonals.
+        float folded_u = (1 - fabs(v)) * (u >= 0 ? 1 : -1);
+        v = (1 - fabs(u)) * (v >= 0 ? 1 : -1);
+        u = folded_u;
+    }
+    int16_t qu = (int16_t)roundf(glm::clamp(u, -1.0f, 1.0f) * 32767);
+    int16_t qv = (int16_t)roundf(glm::clamp(v, -1.0f, 1.0f) * 32767);
+    return (uint32_t)(uint16_t)qu | ((uint32_t)(uint16_t)qv << 16);
+}
+
+// The unit normal back from encode_normal(). Same as decode_normal() in tracer.cl.
+inline glm::vec3 decode_normal(const uint32_t packed)
+{
+    const float x = (int16_t)(packed & 0xffff) / 32767.0f;
+    const float y = (int16_t)(packed >> 16) / 32767.0f;
+    glm::vec3 n(x, y, 1 - fabsf(x) - fabsf(y));
+    if (n.z < 0)
+    {  // Unfold the lower half.
+        n.x = (1 - fabsf(y)) * (x >= 0 ? 1 : -1);
+        n.y = (1 - fabsf(x)) * (y >= 0 ? 1 : -1);
+    }
+    return glm::normalize(n);
+}
+
+// The vertex normals of a triangle, one per vertex in p0, p1, p2.
+inline CLpackedNormals pack_normals(const CLtriangle& norm)
+{
+    CLpackedNormals packed;
+    packed.n[0] = encode_normal(norm.p0);
+    packed.n[1] = encode_normal(norm.p1);
+    packed.n[2] = encode_normal(norm.p2);
+    return packed;
+}
+
+// A triangle as the tracer intersects it (Woop's unit triangle test), built
+// from a CLtriangle at upload. Row k gives coordinate k of a point p in the
+// space where the triangle is the unit triangle and its normal is the z axis:
+// p0, p1, p2 -> (0,0,0), (1,0,0), (0,1,0). coordinate_k = dot(row_k.xyz, p) + row_k.w
+struct CLwoopTriangle
+{
+    float rows[3][4];
+    CLvec3 _padding;
+};
+
+// Used by the OpenCL and the CPU tracer when triangles are uploaded.
+inline CLwoopTriangle make_woop_triangle(const CLtriangle& tri)
+{
+    CLwoopTriangle woop = {};
+    glm::dvec3 p0(tri.p0.x, tri.p0.y, tri.p0.z);
+    glm::dvec3 e1 = glm::dvec3(tri.p1.x, tri.p1.y, tri.p1.z) - p0;
+    glm::dvec3 e2 = glm::dvec3(tri.p2.x, tri.p2.y, tri.p2.z) - p0;
+    glm::dmat3 to_world(e1, e2, glm::cross(e1, e2));
+    if (glm::determinant(to_world) == 0)
+    {
+        // Degenerate. The ray never reaches the z = 0 plane: t = -1 / 0.
+        woop.rows[2][3] = 1;
+        return woop;
+    }
+    glm::dmat3 to_unit = glm::inverse(to_world);
+    for (int k = 0; k < 3; ++k)
+    {
+        glm::dvec3 row(to_unit[0][k], to_unit[1][k], to_unit[2][k]);
+        woop.rows[k][0] = (float)row.x;
+        woop.rows[k][1] = (float)row.y;
+        woop.rows[k][2] = (float)row.z;
+        woop.rows[k][3] = (float)-glm::dot(row, p0);
+    }
+    return woop;
+}
+
+// A scene of voxels on a regular grid, traced without a BVH (see trace_grid()
+// in tracer.cl). The grid is made of bricks of kBrickSize^3 voxels. Each cell
+// of the grid holds the index of its brick, or -1 when it is empty, and each
+// brick is kBrickWords words with one bit per voxel, x first, then y, then z.
+static const int kBrickSizeLog2 = 3;
+static const int kBrickSize = 1 << kBrickSizeLog2;
+static const int kBrickWords = kBrickSize * kBrickSize * kBrickSize / 32;
+
+struct CLvoxelGrid
+{
+    float origin[3];        // Corner of voxel (0, 0, 0).
+    float voxel_size;
+    int size[3];            // In bricks. Cells are indexed (z * size[1] + y) * size[0] + x
+    int num_bricks;
+};
+
 // Note: When brute force ray tracing:
 // The extra level of indirection has no perceivable overhead compared to
 // tracing against a triangle pool.
 struct Primitive
 {
     int offset;             // Num of elements into the triangle pool where this primitive begins.
-    int num_triangles;
+                            // Analytic primitives: index into the shape pool (see scene.cc).
+    int num_triangles;      // 0 for analytic primitives.
     int material;           // Enum (copy in shader).
+    int type;               // PrimitiveType
 };
 }
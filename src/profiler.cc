@@ -0,0 +1,183 @@
+#include "profiler.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define PH_THREAD_LOCAL __declspec(thread)
+#else
+#define PH_THREAD_LOCAL __thread
+#endif
+
+namespace ph
+{
+namespace profiler
+{
+
+struct Zone
+{
+    const char* name;
+    uint64      begin_us;
+    uint64      end_us;
+};
+
+// One per thread. Only the owner thread writes `zones` and `head`.
+struct ThreadBuffer
+{
+    Zone*           zones;          // kRingSize elements.
+    volatile int64  head;           // Total number of zones ever recorded.
+    int64           thread_index;   // Small id for the trace viewer.
+    ThreadBuffer*   next;           // Intrusive list of all buffers.
+};
+
+static ThreadBuffer* volatile           m_buffers = NULL;
+static volatile int64                   m_num_threads = 0;
+static const char*                      m_exit_path = NULL;
+static PH_THREAD_LOCAL ThreadBuffer*    m_thread_buffer = NULL;
+
+////////////////////////////////////////
+// Atomics
+////////////////////////////////////////
+
+static void store_release(volatile int64* dst, int64 val)
+{
+#if defined(_MSC_VER)
+    _ReadWriteBarrier();
+    *dst = val;
+#else
+    __atomic_store_n(dst, val, __ATOMIC_RELEASE);
+#endif
+}
+
+static int64 load_acquire(volatile int64* src)
+{
+#if defined(_MSC_VER)
+    int64 val = *src;
+    _ReadWriteBarrier();
+    return val;
+#else
+    return __atomic_load_n(src, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static int64 fetch_add(volatile int64* dst, int64 val)
+{
+#if defined(_MSC_VER)
+    return _InterlockedExchangeAdd64((volatile long long*)dst, val);
+#else
+    return __atomic_fetch_add(dst, val, __ATOMIC_ACQ_REL);
+#endif
+}
+
+static void push_buffer(ThreadBuffer* buffer)
+{
+    for (;;)
+    {
+        ThreadBuffer* head = m_buffers;
+        buffer->next = head;
+#if defined(_MSC_VER)
+        if (_InterlockedCompareExchangePointer((void* volatile*)&m_buffers, buffer, head) == head)
+#else
+        if (__sync_bool_compare_and_swap(&m_buffers, head, buffer))
+#endif
+        {
+            return;
+        }
+    }
+}
+
+static ThreadBuffer* get_thread_buffer()
+{
+    if (!m_thread_buffer)
+    {
+        ThreadBuffer* buffer = phalloc(ThreadBuffer, 1);
+        buffer->zones = phalloc(Zone, kRingSize);
+        buffer->head = 0;
+        buffer->thread_index = fetch_add(&m_num_threads, 1);
+        buffer->next = NULL;
+        push_buffer(buffer);
+        m_thread_buffer = buffer;
+    }
+    return m_thread_buffer;
+}
+
+void record(const char* name, uint64 begin_us, uint64 end_us)
+{
+    ThreadBuffer* buffer = get_thread_buffer();
+    int64 head = buffer->head;
+    Zone* zone = &buffer->zones[head % kRingSize];
+    zone->name = name;
+    zone->begin_us = begin_us;
+    zone->end_us = end_us;
+    // Publish after the zone is written, so dump() never sees a half-written zone at head.
+    store_release(&buffer->head, head + 1);
+}
+
+static void write_zone(FILE* fd, const Zone* zone, int64 thread_index, bool* first)
+{
+    fprintf(fd, "%s\n{\"name\":\"", *first ? "" : ",");
+    for (const char* c = zone->name; *c; ++c)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            fputc('\\', fd);
+        }
+        fputc(*c, fd);
+    }
+    fprintf(fd, "\",\"ph\":\"X\",\"pid\":1,\"tid\":%" PRId64 ",\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 "}",
+            thread_index, zone->begin_us, zone->end_us - zone->begin_us);
+    *first = false;
+}
+
+void dump(const char* path)
+{
+    FILE* fd = fopen(path, "w");
+    if (!fd)
+    {
+        logf("profiler: could not open %s\n", path);
+        return;
+    }
+    Zone* copy = phalloc(Zone, kRingSize);
+    bool first = true;
+    fprintf(fd, "{\"traceEvents\":[");
+    for (ThreadBuffer* buffer = m_buffers; buffer != NULL; buffer = buffer->next)
+    {
+        // The owner keeps writing while we read. Copy, then drop whatever it may have
+        // overwritten in the meantime.
+        int64 head = load_acquire(&buffer->head);
+        int64 first_i = head > kRingSize ? head - kRingSize : 0;
+        for (int64 i = first_i; i < head; ++i)
+        {
+            copy[i - first_i] = buffer->zones[i % kRingSize];
+        }
+        int64 new_head = load_acquire(&buffer->head);
+        // The owner may be writing zone new_head right now, over zone new_head - kRingSize.
+        int64 valid_from = new_head + 1 > kRingSize ? new_head + 1 - kRingSize : 0;
+        for (int64 i = first_i; i < head; ++i)
+        {
+            if (i >= valid_from)
+            {
+                write_zone(fd, &copy[i - first_i], buffer->thread_index, &first);
+            }
+        }
+    }
+    fprintf(fd, "\n]}\n");
+    fclose(fd);
+    phree(copy);
+    logf("profiler: wrote %s\n", path);
+}
+
+static void dump_exit_path()
+{
+    dump(m_exit_path);
+}
+
+void dump_at_exit(const char* path)
+{
+    if (m_exit_path == NULL)
+    {
+        atexit(dump_exit_path);
+    }
+    m_exit_path = path;
+}
+
+}  // ns profiler
+}  // ns ph
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <ph.h>
+
+#include "io.h"
+
+////////////////////////////////////////
+// ph::profiler
+// Scoped timing zones for hot paths.
+//
+// Every thread records into its own ring
+// buffer, so recording never takes a lock.
+// dump() writes the zones as Chrome trace
+// JSON (chrome://tracing or ui.perfetto.dev).
+// Usage example:
+//
+//  void update_structure()
+//  {
+//      PH_PROFILE_SCOPE("update_structure");
+//      ...
+//  }
+//
+// For spans that are not a C++ scope:
+//
+//  PH_PROFILE_BEGIN(trace);
+//  ...
+//  PH_PROFILE_END(trace, "trace");
+//
+// Zones compile to nothing unless PH_PROFILE
+// is defined (see CMakeLists.txt).
+////////////////////////////////////////
+
+namespace ph
+{
+namespace profiler
+{
+
+// Zones kept per thread. Older zones are overwritten.
+static const int64 kRingSize = 1 << 16;
+
+// Record a finished zone. Times come from io::get_microseconds(). `name` must
+// outlive the profiler (use string literals).
+void record(const char* name, uint64 begin_us, uint64 end_us);
+
+// Write every recorded zone to `path` as Chrome trace JSON. Can be called at any time.
+void dump(const char* path);
+
+// Dump to `path` when the process exits.
+void dump_at_exit(const char* path);
+
+struct ScopedZone
+{
+    const char* name;
+    uint64      begin_us;
+
+    ScopedZone(const char* zone_name)
+    {
+        name = zone_name;
+        begin_us = io::get_microseconds();
+    }
+    ~ScopedZone()
+    {
+        record(name, begin_us, io::get_microseconds());
+    }
+};
+
+}  // ns profiler
+}  // ns ph
+
+#define PH_PROFILE_CONCAT_(a, b) a##b
+#define PH_PROFILE_CONCAT(a, b) PH_PROFILE_CONCAT_(a, b)
+
+#ifdef PH_PROFILE
+#define PH_PROFILE_SCOPE(name) \
+    ph::profiler::ScopedZone PH_PROFILE_CONCAT(ph_profile_zone_, __LINE__)(name)
+#define PH_PROFILE_BEGIN(id) \
+    ph::uint64 ph_profile_begin_##id = ph::io::get_microseconds()
+#define PH_PROFILE_END(id, name) \
+    ph::profiler::record(name, ph_profile_begin_##id, ph::io::get_microseconds())
+#else
+#define PH_PROFILE_SCOPE(name)
+#define PH_PROFILE_BEGIN(id)
+#define PH_PROFILE_END(id, name)
+#endif
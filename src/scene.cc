@@ -1,8 +1,10 @@
 ﻿#include "scene.h"
 
 #include <ocl.h>
+#include "cpu_tracer.h"
 #include "ocl_interop_structs.h"
 #include <ph_gl.h>
+#include "profiler.h"
 
 
 namespace ph
@@ -16,17 +18,25 @@ static const int kTreeStackLimit = 64;
 struct GLlight;
 
 static Slice<ph::CLtriangle> m_triangle_pool;
-static Slice<ph::CLtriangle> m_normal_pool;
+static Slice<ph::CLpackedNormals> m_normal_pool;
+// Analytic primitives, which are described by their bounds. Indexed by Primitive.offset.
+static Slice<AABB>           m_shape_pool;
+// The pools above in depth first leaf order, as uploaded. See order_triangles_by_leaf().
+static Slice<ph::CLtriangle>  m_leaf_triangles;
+static Slice<ph::CLpackedNormals> m_leaf_normals;
 static Slice<GLlight>        m_light_pool;
 static Slice<ph::Primitive>  m_primitives;
+// Voxel grid scenes, see init_voxel_grid().
+static bool                  m_voxel_scene = false;
+static ph::CLvoxelGrid       m_voxel_grid;
+static Slice<int>            m_grid_cells;
+static Slice<uint32_t>       m_bricks;
 static ph::BVHNode*          m_flat_tree = NULL;
 static int64                 m_flat_tree_len = 0;
 static int                   m_debug_bvh_height = -1;
-static GLuint                m_bvh_buffer;
-static GLuint                m_triangle_buffer;
-static GLuint                m_normal_buffer;
-static GLuint                m_light_buffer;
-static GLuint                m_prim_buffer;
+static bool                  m_is_init = false;
+// See set_headless(). Builds with PH_HEADLESS have no OpenCL tracer to upload to.
+static bool                  m_headless = false;
 
 
 struct GLlight
@@ -61,19 +71,21 @@ static const char* str(AABB b)
     return out;
 }
 
+static void bbox_grow(AABB* bbox, float x, float y, float z)
+{
+    if (x < bbox->xmin) bbox->xmin = x;
+    if (x > bbox->xmax) bbox->xmax = x;
+    if (y < bbox->ymin) bbox->ymin = y;
+    if (y > bbox->ymax) bbox->ymax = y;
+    if (z < bbox->zmin) bbox->zmin = z;
+    if (z > bbox->zmax) bbox->zmax = z;
+}
+
 static ph::AABB get_bbox(const ph::Primitive* primitives, int count)
 {
     ph_assert(count > 0);
     AABB bbox;
-    { // Fill bbox with not-nonsense
-        auto first = m_triangle_pool[primitives[0].offset];
-        bbox.xmin = first.p0.x;
-        bbox.xmax = first.p0.x;
-        bbox.ymin = first.p0.y;
-        bbox.ymax = first.p0.y;
-        bbox.zmin = first.p0.z;
-        bbox.zmax = first.p0.z;
-    }
+    bbox_fill(&bbox);
     for (int pi = 0; pi < count; ++pi)
     {
         auto primitive = primitives[pi];
@@ -82,19 +94,20 @@ static ph::AABB get_bbox(const ph::Primitive* primitives, int count)
             return bbox;
         }
 
+        if (primitive.type != PrimitiveType_Triangles)
+        {
+            AABB shape = m_shape_pool[primitive.offset];
+            bbox_grow(&bbox, shape.xmin, shape.ymin, shape.zmin);
+            bbox_grow(&bbox, shape.xmax, shape.ymax, shape.zmax);
+            continue;
+        }
         for (int i = primitive.offset; i < primitive.offset + primitive.num_triangles; ++i)
         {
             ph::CLtriangle tri = m_triangle_pool[i];
             CLvec3 points[3] = { tri.p0, tri.p1, tri.p2 };
             for (int j = 0; j < 3; ++j)
             {
-                auto p = points[j];
-                if (p.x < bbox.xmin) bbox.xmin = p.x;
-                if (p.x > bbox.xmax) bbox.xmax = p.x;
-                if (p.y < bbox.ymin) bbox.ymin = p.y;
-                if (p.y > bbox.ymax) bbox.ymax = p.y;
-                if (p.z < bbox.zmin) bbox.zmin = p.z;
-                if (p.z > bbox.zmax) bbox.zmax = p.z;
+                bbox_grow(&bbox, points[j].x, points[j].y, points[j].z);
             }
         }
     }
@@ -138,6 +151,7 @@ struct BVHTreeNode
     BVHTreeNode* right;
     BVHTreeNode* parent;
     BVHTreeNode* sibling;
+    int split_axis;  // Inner nodes. The left child is on the lower side.
 };
 
 enum SplitPlane
@@ -159,6 +173,7 @@ static BVHTreeNode* build_bvh(
     data.right_child_offset = -1;
     node->parent = NULL;
     node->sibling = NULL;
+    node->split_axis = 0;
 
     ph_assert(count(primitives) != 0);
     data.bbox = get_bbox(primitives.ptr, (int)count(primitives));
@@ -204,6 +219,7 @@ static BVHTreeNode* build_bvh(
                 split = i;
             }
         }
+        node->split_axis = split;
 
 
         // Make two new slices.
@@ -559,6 +575,22 @@ static uint64_t hash(BVHTreeNode* data)
     return hash;
 }
 
+// Flat index of the node that follows the subtree of `fatnode` in depth first
+// order, `len` if there is none. That is the right sibling of the first node on
+// the way up (itself included) that is a left child.
+static int64 get_escape_offset(BVHTreeNode* fatnode, Dict<BVHTreeNode*, int64>* dict, int64 len)
+{
+    while (fatnode->parent != NULL)
+    {
+        if (fatnode->parent->left == fatnode)
+        {
+            return *find(dict, fatnode->sibling);
+        }
+        fatnode = fatnode->parent;
+    }
+    return len;
+}
+
 // Returns a memory-managed array of BVHNode in depth first order. Ready for GPU consumption.
 static ph::BVHNode* flatten_bvh(BVHTreeNode* root, int64* out_len)
 {
@@ -599,8 +631,11 @@ static ph::BVHNode* flatten_bvh(BVHTreeNode* root, int64* out_len)
             stack[stack_offset++] = fatnode->left;
             int64 found_i = *find(&dict, fatnode->right);
             ph_assert(found_i >= 0);
-            ph_assert(found_i < int64(1) << 31);
-            slice.ptr[i].right_child_offset = (int)found_i;
+            ph_assert(found_i < kLocalNodeBit);
+            slice.ptr[i].right_child_offset = (int)found_i | (fatnode->split_axis << kSplitAxisShift);
+            int64 escape_i = get_escape_offset(fatnode, &dict, count(slice));
+            ph_assert(escape_i > found_i);
+            slice.ptr[i].primitive_offset = -(int)escape_i;
         }
         i++;
     }
@@ -611,8 +646,13 @@ static ph::BVHNode* flatten_bvh(BVHTreeNode* root, int64* out_len)
     return slice.ptr;
 }
 
-static bool validate_flattened_bvh(ph::BVHNode* root, int64 len)
+bool validate_flattened_bvh(const ph::BVHNode* root, int64 len)
 {
+    if (len > 0 && root->primitive_offset < 0 && -root->primitive_offset != len)
+    {
+        printf("Bad escape offset at the root\n");
+        return false;
+    }
     bool* check = phalloc(bool, len);
     for (int64 i = 0; i < len; ++i)
     {
@@ -620,21 +660,43 @@ static bool validate_flattened_bvh(ph::BVHNode* root, int64 len)
     }
 
     int64 num_leafs = 0;
-    ph::BVHNode* node = root;
+    const ph::BVHNode* node = root;
     for (int64 i = 0; i < len; ++i)
     {
         /* printf("Node %ld: At its right: %d\n", i, node->right_child_offset); */
-        if (node->primitive_offset != -1)
-        {  // Not leaf
+        if (node->primitive_offset >= 0)
+        {  // Leaf
             num_leafs++;
             /* printf("  Leaf! %d\n", node->primitive_offset); */
-            if (check[node->primitive_offset])
+            if (node->primitive_offset >= len || check[node->primitive_offset])
             {
                 printf("Double leaf %d\n", node->primitive_offset);
+                phree(check);
                 return false;
             }
             check[node->primitive_offset] = true;
         }
+        else
+        {  // Inner. The left subtree must end where the right one starts, and the right one where this one ends.
+            int64 escape_i = -node->primitive_offset;
+            int64 right_i = get_right_child(*node);
+            if (right_i <= i + 1 || right_i >= len)
+            {
+                printf("Bad right child at node %ld\n", i);
+                phree(check);
+                return false;
+            }
+            const ph::BVHNode* left = node + 1;
+            const ph::BVHNode* right = root + right_i;
+            int64 left_escape = left->primitive_offset >= 0 ? i + 2 : -left->primitive_offset;
+            int64 right_escape = right->primitive_offset >= 0 ? right_i + 1 : -right->primitive_offset;
+            if (left_escape != right_i || right_escape != escape_i || escape_i > len)
+            {
+                printf("Bad escape offset at node %ld\n", i);
+                phree(check);
+                return false;
+            }
+        }
         node++;
     }
 
@@ -643,6 +705,7 @@ static bool validate_flattened_bvh(ph::BVHNode* root, int64 len)
         if (!check[i])
         {
             printf("Missing leaf %ld\n", i);
+            phree(check);
             return false;
         }
     }
@@ -651,6 +714,41 @@ static bool validate_flattened_bvh(ph::BVHNode* root, int64 len)
     return true;
 }
 
+// Copy the triangles of every leaf of `tree`, in depth first order, to
+// m_leaf_triangles and m_leaf_normals, and point the leaves at their copies.
+// Rays that hit neighbouring leaves then read neighbouring triangles, and the
+// tracer needs no Primitive array. Leaves of analytic primitives need nothing
+// but their bbox; they point at themselves, which gives each a unique hit id.
+static void order_triangles_by_leaf(ph::BVHNode* tree, int64 len)
+{
+    clear(&m_leaf_triangles);
+    clear(&m_leaf_normals);
+    for (int64 i = 0; i < len; ++i)
+    {
+        ph::BVHNode* node = &tree[i];
+        if (node->primitive_offset < 0)
+        {
+            continue;
+        }
+        ph::Primitive prim = m_primitives[node->primitive_offset];
+        if (prim.type != PrimitiveType_Triangles)
+        {
+            node->primitive_offset = (int)i;
+            node->right_child_offset = prim.type << kPrimTypeShift;
+            continue;
+        }
+        int64 first = count(m_leaf_triangles);
+        ph_assert(first + prim.num_triangles < kLocalNodeBit);
+        for (int j = prim.offset; j < prim.offset + prim.num_triangles; ++j)
+        {
+            append(&m_leaf_triangles, m_triangle_pool[j]);
+            append(&m_leaf_normals, m_normal_pool[j]);
+        }
+        node->primitive_offset = (int)first;
+        node->right_child_offset = prim.num_triangles;
+    }
+}
+
 // Return a vec3 with layout expected by the compute shader.
 // Reverse z while we're at it, so it is in view coords.
 static CLvec3 to_cl(glm::vec3 in)
@@ -659,6 +757,12 @@ static CLvec3 to_cl(glm::vec3 in)
     return out;
 }
 
+const ph::BVHNode* get_flat_bvh(int64* num_nodes)
+{
+    *num_nodes = m_flat_tree_len;
+    return m_flat_tree;
+}
+
 void bbox_fill(AABB* bbox)
 {
     bbox->xmax = -INFINITY;
@@ -698,207 +802,26 @@ int64 submit_light(Light* light)
     return light->index;
 }
 
-int64 submit_primitive(Cube* cube, SubmitFlags flags, int64 flag_params)
+// Analytic primitives are their bounds. `*index` is the place of `bounds` in
+// the shape pool; it is set when appending and read when updating.
+static int64 submit_shape(AABB bounds, PrimitiveType type, int32* index, SubmitFlags flags, int64 flag_params)
 {
-    // 6 points of cube
-    //       d----c
-    //      / |  /|
-    //     a----b |
-    //     |  g-|-f
-    //     | /  |/
-    //     h----e
-    // I am an artist!
-
-    // Vertex data
-    glm::vec3 _a,_b,_c,_d,_e,_f,_g,_h;
-    CLvec3 a,b,c,d,e,f,g,h;
-
-    // Normal data for each face
-    CLvec3 nf, nr, nb, nl, nt, nm;
-
-
-    // Temp struct, fill-and-submit.
-    ph::CLtriangle tri;
-    ph::CLtriangle norm;
-
-    // Return index to the first appended triangle.
-    int64 index = -1;
     if (flags & SubmitFlags_Update)
     {
-        index = cube->index;
+        m_shape_pool[*index] = bounds;
     }
     else
-    {  // Append 12 new triangles
-        tri.p0.x = 0;  // Initialize garbage, just to get an index. Will be filled below.
-        index = append(&m_triangle_pool, tri);
-#ifdef PH_DEBUG
-        auto n_index = append(&m_normal_pool, tri);
-        ph_assert(n_index == index);
-#else
-        append(&m_normal_pool, tri);
-#endif
-        for (int i = 0; i < 11; ++i)
-        {
-            append(&m_triangle_pool, tri);
-            append(&m_normal_pool, tri);
-        }
-    }
-
-    _a = glm::vec3(cube->center + glm::vec3(-cube->sizes.x, cube->sizes.y, cube->sizes.z));
-    _b = glm::vec3(cube->center + glm::vec3(cube->sizes.x, cube->sizes.y, cube->sizes.z));
-    _c = glm::vec3(cube->center + glm::vec3(cube->sizes.x, cube->sizes.y, -cube->sizes.z));
-    _d = glm::vec3(cube->center + glm::vec3(-cube->sizes.x, cube->sizes.y, -cube->sizes.z));
-    _e = glm::vec3(cube->center + glm::vec3(cube->sizes.x, -cube->sizes.y, cube->sizes.z));
-    _f = glm::vec3(cube->center + glm::vec3(cube->sizes.x, -cube->sizes.y, -cube->sizes.z));
-    _g = glm::vec3(cube->center + glm::vec3(-cube->sizes.x, -cube->sizes.y, -cube->sizes.z));
-    _h = glm::vec3(cube->center + glm::vec3(-cube->sizes.x, -cube->sizes.y, cube->sizes.z));
-
-
-    a = to_cl(_a);
-    b = to_cl(_b);
-    c = to_cl(_c);
-    d = to_cl(_d);
-    e = to_cl(_e);
-    f = to_cl(_f);
-    g = to_cl(_g);
-    h = to_cl(_h);
-
-
-    // 6 normals
-    nf = to_cl(glm::normalize(glm::cross(_b - _e, _h - _e)));
-    nr = to_cl(glm::normalize(glm::cross(_c - _f, _e - _f)));
-    nb = to_cl(glm::normalize(glm::cross(_d - _g, _f - _g)));
-    nl = to_cl(glm::normalize(glm::cross(_a - _h, _g - _h)));
-    nt = to_cl(glm::normalize(glm::cross(_c - _b, _a - _b)));
-    nm = to_cl(glm::normalize(glm::cross(_e - _f, _g - _f)));
-
-    if (flags & SubmitFlags_FlipNormals)
     {
-        CLvec3* normals[] = {&nf, &nr, &nb, &nl, &nt, &nm};
-        for (int i = 0; i < 6; ++i)
-        {
-            normals[i]->x *= -1;
-            normals[i]->y *= -1;
-            normals[i]->z *= -1;
-        }
+        int64 shape_i = append(&m_shape_pool, bounds);
+        ph_assert(shape_i <= PH_MAX_int32);
+        *index = (int32)shape_i;
     }
 
-    // Front face
-    tri.p0 = h;
-    tri.p1 = b;
-    tri.p2 = a;
-    norm.p0 = nf;
-    norm.p1 = nf;
-    norm.p2 = nf;
-    m_triangle_pool[index + 0] = tri;
-    m_normal_pool[index + 0] = norm;
-    tri.p0 = h;
-    tri.p1 = e;
-    tri.p2 = b;
-    norm.p0 = nf;
-    norm.p1 = nf;
-    norm.p2 = nf;
-    m_triangle_pool[index + 1] = tri;
-    m_normal_pool[index + 1] = norm;
-
-    // Right
-    tri.p0 = e;
-    tri.p1 = c;
-    tri.p2 = b;
-    norm.p0 = nr;
-    norm.p1 = nr;
-    norm.p2 = nr;
-    m_triangle_pool[index + 2] = tri;
-    m_normal_pool[index + 2] = norm;
-    tri.p0 = e;
-    tri.p1 = c;
-    tri.p2 = f;
-    norm.p0 = nr;
-    norm.p1 = nr;
-    norm.p2 = nr;
-    m_triangle_pool[index + 3] = tri;
-    m_normal_pool[index + 3] = norm;
-
-    // Back
-    tri.p0 = d;
-    tri.p1 = c;
-    tri.p2 = g;
-    norm.p0 = nb;
-    norm.p1 = nb;
-    norm.p2 = nb;
-    m_triangle_pool[index + 4] = tri;
-    m_normal_pool[index + 4] = norm;
-    tri.p0 = c;
-    tri.p1 = f;
-    tri.p2 = g;
-    norm.p0 = nb;
-    norm.p1 = nb;
-    norm.p2 = nb;
-    m_triangle_pool[index + 5] = tri;
-    m_normal_pool[index + 5] = norm;
-
-    // Left
-    tri.p0 = a;
-    tri.p1 = h;
-    tri.p2 = d;
-    norm.p0 = nl;
-    norm.p1 = nl;
-    norm.p2 = nl;
-    m_triangle_pool[index + 6] = tri;
-    m_normal_pool[index + 6] = norm;
-    tri.p0 = h;
-    tri.p1 = d;
-    tri.p2 = g;
-    norm.p0 = nl;
-    norm.p1 = nl;
-    norm.p2 = nl;
-    m_triangle_pool[index + 7] = tri;
-    m_normal_pool[index + 7] = norm;
-    tri.p0 = h;
-
-    // Top
-    tri.p0 = a;
-    tri.p1 = c;
-    tri.p2 = d;
-    norm.p0 = nt;
-    norm.p1 = nt;
-    norm.p2 = nt;
-    m_triangle_pool[index + 8] = tri;
-    m_normal_pool[index + 8] = norm;
-    tri.p0 = h;
-    tri.p0 = a;
-    tri.p1 = b;
-    tri.p2 = c;
-    norm.p0 = nt;
-    norm.p1 = nt;
-    norm.p2 = nt;
-    m_triangle_pool[index + 9] = tri;
-    m_normal_pool[index + 9] = norm;
-
-    // Bottom
-    tri.p0 = h;
-    tri.p1 = f;
-    tri.p2 = g;
-    norm.p0 = nm;
-    norm.p1 = nm;
-    norm.p2 = nm;
-    m_triangle_pool[index + 10] = tri;
-    m_normal_pool[index + 10] = norm;
-    tri.p0 = h;
-    tri.p1 = e;
-    tri.p2 = f;
-    norm.p0 = nm;
-    norm.p1 = nm;
-    norm.p2 = nm;
-    m_triangle_pool[index + 11] = tri;
-    m_normal_pool[index + 11] = norm;
-
-    ph_assert(index <= PH_MAX_int32);
-    cube->index = (int)index;
     ph::Primitive prim;
-    prim.offset = cube->index;
-    prim.num_triangles = 12;
+    prim.offset = *index;
+    prim.num_triangles = 0;
     prim.material = MaterialType_Lambert;
+    prim.type = type;
     if (flags & SubmitFlags_Update)
     {
         ph_assert(flag_params >= 0 && flag_params < count(m_primitives));
@@ -911,12 +834,32 @@ int64 submit_primitive(Cube* cube, SubmitFlags flags, int64 flag_params)
     }
 }
 
-static int64 submit_primitive(AABB* bbox)
+int64 submit_primitive(Cube* cube, SubmitFlags flags, int64 flag_params)
+{
+    // A cube is a box primitive: the tracer intersects its bounds directly.
+    // The normal of the hit face is turned towards the ray, so cubes seen from
+    // inside need no SubmitFlags_FlipNormals.
+    AABB box;
+    box.xmin = cube->center.x - cube->sizes.x;
+    box.xmax = cube->center.x + cube->sizes.x;
+    box.ymin = cube->center.y - cube->sizes.y;
+    box.ymax = cube->center.y + cube->sizes.y;
+    box.zmin = cube->center.z - cube->sizes.z;
+    box.zmax = cube->center.z + cube->sizes.z;
+    return submit_shape(box, PrimitiveType_Box, &cube->index, flags, flag_params);
+}
+
+int64 submit_primitive(Sphere* sphere, SubmitFlags flags, int64 flag_params)
 {
-    glm::vec3 center = {(bbox->xmax + bbox->xmin) / 2,
-        (bbox->ymax + bbox->ymin) / 2, (bbox->zmax + bbox->zmin) / 2};
-    Cube cube = make_cube(center.x, center.y, center.z, bbox->xmax - center.x, bbox->ymax - center.y, bbox->zmax - center.y);
-    return submit_primitive(&cube);
+    // The tracer takes the sphere inscribed in the bounds.
+    AABB bounds;
+    bounds.xmin = sphere->center.x - sphere->radius;
+    bounds.xmax = sphere->center.x + sphere->radius;
+    bounds.ymin = sphere->center.y - sphere->radius;
+    bounds.ymax = sphere->center.y + sphere->radius;
+    bounds.zmin = sphere->center.z - sphere->radius;
+    bounds.zmax = sphere->center.z + sphere->radius;
+    return submit_shape(bounds, PrimitiveType_Sphere, &sphere->index, flags, flag_params);
 }
 
 int64 submit_primitive(Chunk* chunk, SubmitFlags flags, int64)
@@ -949,11 +892,11 @@ int64 submit_primitive(Chunk* chunk, SubmitFlags flags, int64)
 
 #ifdef PH_DEBUG
         auto vi = append(&m_triangle_pool, tri);
-        auto ni = append(&m_normal_pool, norm);
+        auto ni = append(&m_normal_pool, pack_normals(norm));
         ph_assert(vi == ni);
 #else
         append(&m_triangle_pool, tri);
-        append(&m_normal_pool, norm);
+        append(&m_normal_pool, pack_normals(norm));
 #endif
     }
 
@@ -963,6 +906,7 @@ int64 submit_primitive(Chunk* chunk, SubmitFlags flags, int64)
     prim.num_triangles = int(chunk->num_verts / 3);
     prim.offset = int(count(m_triangle_pool) - prim.num_triangles);
     prim.material = MaterialType_Lambert;
+    prim.type = PrimitiveType_Triangles;
     auto index = append(&m_primitives, prim);
 
     return index;
@@ -987,38 +931,121 @@ Cube make_cube(float x, float y, float z, float size)
     return make_cube(x,y,z,size,size,size);
 }
 
+Sphere make_sphere(float x, float y, float z, float radius)
+{
+    Sphere s;
+    s.center.x = x;
+    s.center.y = y;
+    s.center.z = z;
+    s.radius = radius;
+    return s;
+}
+
+void init_voxel_grid(glm::vec3 origin, float voxel_size, int size_x, int size_y, int size_z)
+{
+    ph_assert(voxel_size > 0 && size_x > 0 && size_y > 0 && size_z > 0);
+    m_voxel_scene = true;
+    m_voxel_grid.origin[0] = origin.x;
+    m_voxel_grid.origin[1] = origin.y;
+    m_voxel_grid.origin[2] = origin.z;
+    m_voxel_grid.voxel_size = voxel_size;
+    int sizes[3] = { size_x, size_y, size_z };
+    int64 num_cells = 1;
+    for (int k = 0; k < 3; ++k)
+    {
+        m_voxel_grid.size[k] = (sizes[k] + kBrickSize - 1) >> kBrickSizeLog2;
+        num_cells *= m_voxel_grid.size[k];
+    }
+    ph_assert(num_cells <= PH_MAX_int32);
+    m_voxel_grid.num_bricks = 0;
+    clear(&m_grid_cells);
+    clear(&m_bricks);
+    for (int64 i = 0; i < num_cells; ++i)
+    {
+        append(&m_grid_cells, -1);
+    }
+}
+
+void set_voxel(int x, int y, int z)
+{
+    ph_assert(m_voxel_scene);
+    ph_assert(x >= 0 && y >= 0 && z >= 0);
+    const int* size = m_voxel_grid.size;
+    int bx = x >> kBrickSizeLog2;
+    int by = y >> kBrickSizeLog2;
+    int bz = z >> kBrickSizeLog2;
+    ph_assert(bx < size[0] && by < size[1] && bz < size[2]);
+    int64 cell_i = ((int64)bz * size[1] + by) * size[0] + bx;
+    if (m_grid_cells[cell_i] < 0)
+    {  // First voxel of this brick.
+        m_grid_cells[cell_i] = m_voxel_grid.num_bricks++;
+        for (int i = 0; i < kBrickWords; ++i)
+        {
+            append(&m_bricks, (uint32_t)0);
+        }
+    }
+    const int mask = kBrickSize - 1;
+    int bit = (x & mask) + kBrickSize * ((y & mask) + kBrickSize * (z & mask));
+    m_bricks[(int64)m_grid_cells[cell_i] * kBrickWords + (bit >> 5)] |= 1u << (bit & 31);
+}
+
+#ifndef PH_HEADLESS
 static void no_op() {}
+#endif
+
+void set_headless()
+{
+    if (m_is_init)
+    {
+        phatal_error("scene::set_headless called after scene::init");
+    }
+    m_headless = true;
+}
 
 void init()
 {
-    GLCHK(no_op());  // Window library may have left surprises...
-    static bool is_init = false;
-    if (is_init)
+#ifndef PH_HEADLESS
+    if (!m_headless)
+    {
+        GLCHK(no_op());  // Window library may have left surprises...
+    }
+#endif
+    if (m_is_init)
     {
         clear(&m_triangle_pool);
         clear(&m_normal_pool);
+        clear(&m_shape_pool);
+        clear(&m_leaf_triangles);
+        clear(&m_leaf_normals);
         clear(&m_light_pool);
         clear(&m_primitives);
+        clear(&m_grid_cells);
+        clear(&m_bricks);
+        m_voxel_scene = false;
         update_structure();
         upload_everything();
     }
     else
     {
-        // Init the OpenCL backend
-        ocl::init();
+#ifndef PH_HEADLESS
+        if (!m_headless)
+        {
+            // Init the OpenCL backend
+            ocl::init();
+        }
+#endif
 
         m_triangle_pool = MakeSlice<ph::CLtriangle>(1024);
-        m_normal_pool   = MakeSlice<ph::CLtriangle>(1024);
+        m_normal_pool   = MakeSlice<ph::CLpackedNormals>(1024);
+        m_shape_pool    = MakeSlice<AABB>(1024);
+        m_leaf_triangles = MakeSlice<ph::CLtriangle>(1024);
+        m_leaf_normals  = MakeSlice<ph::CLpackedNormals>(1024);
         m_light_pool    = MakeSlice<GLlight>(8);
         m_primitives    = MakeSlice<ph::Primitive>(1024);
-
-        glGenBuffers(1, &m_bvh_buffer);
-        glGenBuffers(1, &m_triangle_buffer);
-        glGenBuffers(1, &m_normal_buffer);
-        glGenBuffers(1, &m_light_buffer);
-        GLCHK ( glGenBuffers(1, &m_prim_buffer) );
+        m_grid_cells    = MakeSlice<int>(1024);
+        m_bricks        = MakeSlice<uint32_t>(1024);
     }
-    is_init = true;
+    m_is_init = true;
 
     // TODO: build a light system.
     Light light;
@@ -1045,18 +1072,26 @@ void update_structure()
         centroids[i] = get_centroid(bbox_cache[i]);
     }
 
-    BVHTreeNode* root = build_bvh(m_primitives, indices, bbox_cache, centroids, 0);
+    BVHTreeNode* root;
+    {
+        PH_PROFILE_SCOPE("build_bvh");
+        root = build_bvh(m_primitives, indices, bbox_cache, centroids, 0);
+    }
 
 #ifdef PH_DEBUG
     validate_bvh(root, m_primitives);
 #endif
 
     if (m_flat_tree) { phree(m_flat_tree); }
-    m_flat_tree = flatten_bvh(root, &m_flat_tree_len);
+    {
+        PH_PROFILE_SCOPE("flatten_bvh");
+        m_flat_tree = flatten_bvh(root, &m_flat_tree_len);
+    }
 
 #ifdef PH_DEBUG
     validate_flattened_bvh(m_flat_tree, m_flat_tree_len);
 #endif
+    order_triangles_by_leaf(m_flat_tree, m_flat_tree_len);
 
     phree(indices);
     phree(centroids);
@@ -1065,17 +1100,60 @@ void update_structure()
 }
 
 // =========================  Upload to GPU
-void upload_everything()
+#ifndef PH_HEADLESS
+static void upload_to_gpu()
 {
+    if (m_voxel_scene)
+    {
+        ocl::set_triangle_soup(NULL, NULL, 0);
+        ocl::set_flat_bvh(NULL, 0);
+        ocl::set_voxel_grid(&m_voxel_grid, m_grid_cells.ptr, m_grid_cells.n_elems,
+                m_bricks.ptr, m_bricks.n_elems);
+        return;
+    }
+    ocl::set_voxel_grid(NULL, NULL, 0, NULL, 0);
     // Upload tree
     // Upload triangles and normals
-    ph_assert(m_triangle_pool.n_elems == m_normal_pool.n_elems);
-    ocl::set_triangle_soup(m_triangle_pool.ptr, m_normal_pool.ptr, m_triangle_pool.n_elems);
-    // Upload primitive data
-    ocl::set_primitive_array(m_primitives.ptr, (size_t)m_primitives.n_elems);
+    ocl::set_triangle_soup(m_leaf_triangles.ptr, m_leaf_normals.ptr, m_leaf_triangles.n_elems);
     // Upload flat bvh.
     ocl::set_flat_bvh(m_flat_tree, (size_t)m_flat_tree_len);
 }
+#endif
+
+static void upload_to_cpu()
+{
+    if (m_voxel_scene)
+    {
+        cpu::set_triangle_soup(NULL, NULL, 0);
+        cpu::set_flat_bvh(NULL, 0);
+        cpu::set_voxel_grid(&m_voxel_grid, m_grid_cells.ptr, m_grid_cells.n_elems,
+                m_bricks.ptr, m_bricks.n_elems);
+        return;
+    }
+    cpu::set_voxel_grid(NULL, NULL, 0, NULL, 0);
+    cpu::set_triangle_soup(m_leaf_triangles.ptr, m_leaf_normals.ptr, m_leaf_triangles.n_elems);
+    cpu::set_flat_bvh(m_flat_tree, (size_t)m_flat_tree_len);
+}
+
+void upload_everything()
+{
+    PH_PROFILE_SCOPE("upload_everything");
+    // Voxel grid scenes upload an empty BVH, and the other way around, so the
+    // tracer never sees what the last scene left.
+    // The CPU tracer gets the same data, once something has started it.
+    // Headless scenes have no OpenCL tracer.
+    ph_assert(m_voxel_scene || m_leaf_triangles.n_elems == m_leaf_normals.n_elems);
+#ifndef PH_HEADLESS
+    if (!m_headless)
+    {
+        upload_to_gpu();
+    }
+#endif
+    if (cpu::is_initialized())
+    {
+        upload_to_cpu();
+    }
+}
 
 } // ns scene
 } // ns ph
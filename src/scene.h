@@ -4,6 +4,11 @@
 
 #include "AABB.h"
 
+namespace ph
+{
+struct BVHNode;
+}
+
 ////////////////////////////////////////
 //          -- ph::scene --
 // Handle the creation of primitives
@@ -32,12 +37,21 @@ struct Cube
 {
     glm::vec3 center;
     glm::vec3 sizes;
-    int32 index = -1; //  Place in triangle pool where associated triangles begin.
+    int32 index = -1; //  Place in the shape pool where its box is.
 };
 
 Cube make_cube(float x, float y, float z, float size);
 Cube make_cube(float x, float y, float z, float size_x, float size_y, float size_z);
 
+struct Sphere
+{
+    glm::vec3 center;
+    float radius;
+    int32 index = -1; //  Place in the shape pool where its bounds are.
+};
+
+Sphere make_sphere(float x, float y, float z, float radius);
+
 struct Rect
 {
     float x;
@@ -61,6 +75,12 @@ struct Chunk
     int64 num_verts;
 };
 
+// No OpenCL and no GL context: scenes only go to the CPU tracer. Call it
+// before the first init(); afterwards it is a fatal error. Builds with
+// PH_HEADLESS (the headless library) leave the OpenCL tracer out either way.
+void set_headless();
+
+// The first call sets up the tracers. Later calls clear the scene.
 void init();
 
 // ---- submit_primitive
@@ -68,6 +88,20 @@ void init();
 
 int64 submit_primitive(Cube* cube, SubmitFlags flags = SubmitFlags_None, int64 flag_params = 0);
 int64 submit_primitive(Chunk* chunk, SubmitFlags flags = SubmitFlags_None, int64 flag_params = 0);
+int64 submit_primitive(Sphere* sphere, SubmitFlags flags = SubmitFlags_None, int64 flag_params = 0);
+
+// ----------------------
+
+// ---- Voxel grids
+// A scene can be a grid of voxels instead of primitives. The tracer walks the
+// grid directly, so there is no acceleration structure to build and voxels can
+// be added while streaming in: upload_everything() sends the grid as it is.
+// init() goes back to a scene of primitives.
+
+// Make the scene a grid of size_x * size_y * size_z voxels (rounded up to whole
+// bricks, see CLvoxelGrid) with the corner of voxel (0, 0, 0) at `origin`.
+void init_voxel_grid(glm::vec3 origin, float voxel_size, int size_x, int size_y, int size_z);
+void set_voxel(int x, int y, int z);
 
 // ----------------------
 
@@ -81,7 +115,7 @@ void update_structure();
 
 // ---- Functions to upload scene info to GPU.
 
-// Submit data about primitives to GPU.
+// Submit data about primitives to GPU, and to the CPU tracer once it is initialized.
 void upload_everything();
 
 // ----------------------
@@ -93,5 +127,15 @@ void upload_everything();
 
 void bbox_fill(AABB* bbox);
 
+// The tree of the last update_structure(), as uploaded: leaves point at their
+// triangles (see BVHNode). NULL when there is none.
+const ph::BVHNode* get_flat_bvh(int64* num_nodes);
+
+// Check a tree as flatten_bvh() returns it, before its leaves point at their
+// triangles: every primitive is in one leaf, every right child follows its
+// left subtree and every escape offset is where the node's subtree ends.
+// Prints the first problem and returns false.
+bool validate_flattened_bvh(const ph::BVHNode* root, int64 len);
+
 }  // ns scene
 }  // ns ph
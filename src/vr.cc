@@ -1,6 +1,7 @@
 #include "vr.h"
 
 #include "ph_gl.h"
+#include "profiler.h"
 #include "window.h"
 
 
@@ -22,10 +23,14 @@ static GLuint                    m_quad_program;
 static GLuint                    m_compute_program;
 
 static float                     m_default_eye_z;       // Eye distance from plane.
+#ifndef PH_HEADLESS
 static const OVR::HMDInfo*       m_hmdinfo;
 static const OVR::HmdRenderInfo* m_renderinfo;
+#endif
 static float                     m_screen_size_m[2];    // Screen size in meters
+#ifndef PH_HEADLESS
 static GLuint                    m_program = 0;
+#endif
 static GLuint                    m_postprocess_program = 0;
 static GLuint                    m_screen_tex;
 static GLuint                    m_backbuffer_tex;
@@ -34,24 +39,71 @@ static float                     m_lens_center_r[2];
 static bool                      m_do_postprocessing = true;
 static bool                      m_do_interlace_throttling = false;
 static bool                      m_skybox_enabled = true;
+#ifndef PH_HEADLESS
 static ovrEyeRenderDesc          m_render_desc_l;
 static ovrEyeRenderDesc          m_render_desc_r;
+#endif
 static unsigned int              m_frame_index = 1;
 static double                    m_target_frame_time = (1 / 75.0);
 
+static Backend                   m_backend = Backend_Rift;
+
+// One frame of a pose trace.
+struct PoseSample
+{
+    double   time;
+    ovrPosef poses[2];
+};
+
+static FILE*                     m_pose_record = NULL;      // See start_pose_recording()
+static bool                      m_pose_record_started;
+static double                    m_pose_record_t0;
+static Slice<PoseSample>         m_pose_trace;              // See load_pose_trace()
+static int64                     m_pose_trace_frame = 0;
+
+// A DK2 with the default eye relief, as the Rift backend reads it from LibOVR.
+static const float               kDK2K[] =
+{
+    1.003f, 1.02f, 1.042f, 1.066f, 1.094f, 1.126f, 1.162f, 1.203f, 1.25f, 1.31f, 1.38f,
+};
+static const float               kDK2LensSeparation = 0.0635f;
+static const float               kDK2CenterFromTop = 0.03537f;
+static const float               kDK2DownTan = 1.3292f;     // Default field of view.
+static const float               kDK2MetersPerTanAngle = 0.036f;
+static const float               kDK2IPD = 0.064f;
+
 ovrHmd                           m_hmd;
 
 vr::HMDConsts                    m_cached_consts;
 
-void init()
+static void init_simulated_dk2()
 {
-    // Safety net.
-    if (m_has_initted)
-    {
-        phatal_error("vr::init called twice");
-    }
-    m_has_initted = true;
+    float theta = atanf(kDK2DownTan);
+    m_default_eye_z =  2 * fabsf(cosf(2 * theta));
+
+    m_screen_size_m[0] = 0.12576f;
+    m_screen_size_m[1] = 0.07074f;
 
+    m_lens_center_l[0] = (m_screen_size_m[0] / 2) - (kDK2LensSeparation / 2);
+    m_lens_center_l[1] = kDK2CenterFromTop;
+
+    m_lens_center_r[0] = kDK2LensSeparation / 2;
+    m_lens_center_r[1] = kDK2CenterFromTop;
+
+    memcpy(m_cached_consts.lens_centers[EYE_Left], m_lens_center_l, 2 * sizeof(float));
+    memcpy(m_cached_consts.lens_centers[EYE_Right], m_lens_center_r, 2 * sizeof(float));
+
+    m_cached_consts.eye_to_screen = m_default_eye_z;
+
+    m_cached_consts.viewport_size_m[0] = m_screen_size_m[0] / 2;
+    m_cached_consts.viewport_size_m[1] = m_screen_size_m[1];
+    m_cached_consts.meters_per_tan_angle = kDK2MetersPerTanAngle;
+}
+
+#ifndef PH_HEADLESS
+// LibOVR and a Rift. Left out of the headless build, which links no LibOVR.
+static void init_rift()
+{
     if (!ovr_Initialize())
     {
         ph::phatal_error("Could not initialize OVR\n");
@@ -108,6 +160,30 @@ void init()
     m_cached_consts.meters_per_tan_angle =
         m_renderinfo->EyeLeft.Distortion.MetersPerTanAngleAtCenter;
 }
+#endif
+
+void init(Backend backend)
+{
+    // Safety net.
+    if (m_has_initted)
+    {
+        phatal_error("vr::init called twice");
+    }
+    m_has_initted = true;
+    m_backend = backend;
+
+    if (m_backend == Backend_SimulatedDK2)
+    {
+        init_simulated_dk2();
+        return;
+    }
+
+#ifdef PH_HEADLESS
+    phatal_error("The headless build has no Rift backend");
+#else
+    init_rift();
+#endif
+}
 
 const HMDConsts get_hmd_constants()
 {
@@ -125,7 +201,147 @@ void fill_catmull_K (float* K, int num_coefficients)
 
     for (int i = 0; i < num_coefficients; ++i)
     {
-        K[i] = m_renderinfo->EyeLeft.Distortion.K[i];
+#ifdef PH_HEADLESS
+        K[i] = kDK2K[i];
+#else
+        K[i] = (m_backend == Backend_SimulatedDK2) ? kDK2K[i] : m_renderinfo->EyeLeft.Distortion.K[i];
+#endif
+    }
+}
+
+bool start_pose_recording(const char* path)
+{
+    stop_pose_recording();
+    m_pose_record = fopen(path, "w");
+    if (!m_pose_record)
+    {
+        return false;
+    }
+    fprintf(m_pose_record, "# time  left: qx qy qz qw px py pz  right: qx qy qz qw px py pz\n");
+    m_pose_record_started = false;
+    return true;
+}
+
+void stop_pose_recording()
+{
+    if (m_pose_record)
+    {
+        fclose(m_pose_record);
+        m_pose_record = NULL;
+    }
+}
+
+static void record_poses(const ovrPosef* poses, double frame_time)
+{
+    if (!m_pose_record_started)
+    {
+        m_pose_record_t0 = frame_time;
+        m_pose_record_started = true;
+    }
+    fprintf(m_pose_record, "%.6f", frame_time - m_pose_record_t0);
+    for (int i = 0; i < EYE_Count; ++i)
+    {
+        const ovrQuatf& q = poses[i].Orientation;
+        const ovrVector3f& p = poses[i].Position;
+        fprintf(m_pose_record, "  %.9g %.9g %.9g %.9g %.9g %.9g %.9g", q.x, q.y, q.z, q.w, p.x, p.y, p.z);
+    }
+    fprintf(m_pose_record, "\n");
+}
+
+bool load_pose_trace(const char* path)
+{
+    if (m_backend != Backend_SimulatedDK2)
+    {
+        phatal_error("Pose traces are replayed by the simulated HMD only");
+    }
+    FILE* fd = fopen(path, "r");
+    if (!fd)
+    {
+        return false;
+    }
+    if (m_pose_trace.ptr)
+    {
+        clear(&m_pose_trace);
+    }
+    else
+    {
+        m_pose_trace = MakeSlice<PoseSample>(1024);
+    }
+    char line[512];
+    int line_num = 0;
+    bool ok = true;
+    while (fgets(line, sizeof(line), fd))
+    {
+        ++line_num;
+        if (line[0] == '#' || line[0] == '\n' || line[0] == '\r')
+        {
+            continue;
+        }
+        PoseSample sample;
+        float v[2][7];
+        int n = sscanf(line, "%lf %f %f %f %f %f %f %f %f %f %f %f %f %f %f", &sample.time,
+                &v[0][0], &v[0][1], &v[0][2], &v[0][3], &v[0][4], &v[0][5], &v[0][6],
+                &v[1][0], &v[1][1], &v[1][2], &v[1][3], &v[1][4], &v[1][5], &v[1][6]);
+        if (n != 15)
+        {
+            fprintf(stderr, "ERROR: %s:%d is not a pose\n", path, line_num);
+            ok = false;
+            break;
+        }
+        for (int i = 0; i < EYE_Count; ++i)
+        {
+            ovrPosef* pose = &sample.poses[i];
+            pose->Orientation.x = v[i][0];
+            pose->Orientation.y = v[i][1];
+            pose->Orientation.z = v[i][2];
+            pose->Orientation.w = v[i][3];
+            pose->Position.x = v[i][4];
+            pose->Position.y = v[i][5];
+            pose->Position.z = v[i][6];
+        }
+        append(&m_pose_trace, sample);
+    }
+    fclose(fd);
+    if (!ok)
+    {
+        clear(&m_pose_trace);
+    }
+    m_pose_trace_frame = 0;
+    return ok;
+}
+
+bool pose_trace_finished()
+{
+    return m_pose_trace.ptr && count(m_pose_trace) > 0 && m_pose_trace_frame >= count(m_pose_trace);
+}
+
+// Next pose of the trace, or the head standing still at the origin when there is none.
+static void simulated_eye_poses(ovrPosef* poses, double* frame_time)
+{
+    const int64 num_samples = m_pose_trace.ptr ? count(m_pose_trace) : 0;
+    if (num_samples == 0)
+    {
+        for (int i = 0; i < EYE_Count; ++i)
+        {
+            poses[i].Orientation.x = 0;
+            poses[i].Orientation.y = 0;
+            poses[i].Orientation.z = 0;
+            poses[i].Orientation.w = 1;
+            poses[i].Position.x = (i == EYE_Left) ? -kDK2IPD / 2 : kDK2IPD / 2;
+            poses[i].Position.y = 0;
+            poses[i].Position.z = 0;
+        }
+        *frame_time = (m_frame_index - 1) * m_target_frame_time;
+        return;
+    }
+    const int64 sample_i = (m_pose_trace_frame < num_samples) ? m_pose_trace_frame : num_samples - 1;
+    const PoseSample& sample = m_pose_trace[sample_i];
+    poses[EYE_Left] = sample.poses[EYE_Left];
+    poses[EYE_Right] = sample.poses[EYE_Right];
+    *frame_time = sample.time;
+    if (m_pose_trace_frame < num_samples)
+    {
+        ++m_pose_trace_frame;
     }
 }
 
@@ -142,31 +358,48 @@ void toggle_interlace_throttle()
 void enable_skybox()
 {
     m_skybox_enabled = true;
+#ifndef PH_HEADLESS
     glUseProgram(m_program);
     glUniform1i(14, m_skybox_enabled);
+#endif
 }
 
 void disable_skybox()
 {
     m_skybox_enabled = false;
+#ifndef PH_HEADLESS
     glUseProgram(m_program);
     glUniform1i(14, m_skybox_enabled);
+#endif
 }
 
 RenderEyePose begin_frame(FrameInfo* frameinfo)
 {
+    PH_PROFILE_SCOPE("begin_frame");
     Eye* left = &frameinfo->left;
     Eye* right = &frameinfo->right;
-    ovrHmd_BeginFrameTiming(m_hmd, m_frame_index);
 
     RenderEyePose eye_pose;
+    if (m_backend == Backend_SimulatedDK2)
     {
+        simulated_eye_poses(eye_pose.poses, &frameinfo->frame_time);
+    }
+#ifndef PH_HEADLESS
+    else
+    {
+        ovrHmd_BeginFrameTiming(m_hmd, m_frame_index);
         ovrVector3f offsets[2] =
         {
             m_render_desc_l.HmdToEyeViewOffset,
             m_render_desc_r.HmdToEyeViewOffset
         };
         ovrHmd_GetEyePoses(m_hmd, 0, offsets, eye_pose.poses, /*ovrTrackingState*/NULL);
+        frameinfo->frame_time = ovr_GetTimeInSeconds();
+    }
+#endif
+    if (m_pose_record)
+    {
+        record_poses(eye_pose.poses, frameinfo->frame_time);
     }
 
     Eye* eyes[2] = { left, right };
@@ -195,15 +428,33 @@ RenderEyePose begin_frame(FrameInfo* frameinfo)
         eyes[i]->orientation[2] = quat[2];
         eyes[i]->orientation[3] = quat[3];
     }
-    frameinfo->frame_time = ovr_GetTimeInSeconds();
 
     return eye_pose;
 }
 
 void end_frame(RenderEyePose* eye_pose, FrameInfo* frameinfo)
 {
-    GLCHK ( glFinish() );
+    PH_PROFILE_SCOPE("end_frame");
+
+    if (m_backend == Backend_SimulatedDK2)
+    {
+        // Nothing to wait for, and the head never moves between tracing and
+        // display: no timewarp.
+        for (int i = 0; i < 2; ++i)
+        {
+            memset(&frameinfo->twmatrices_l[i], 0, sizeof(ovrMatrix4f));
+            memset(&frameinfo->twmatrices_r[i], 0, sizeof(ovrMatrix4f));
+            for (int j = 0; j < 4; ++j)
+            {
+                frameinfo->twmatrices_l[i].M[j][j] = 1;
+                frameinfo->twmatrices_r[i].M[j][j] = 1;
+            }
+        }
+        m_frame_index++;
+        return;
+    }
 
+#ifndef PH_HEADLESS
     // CAPI.h says use this but it doesn't seem necessary.
     double time_elapsed = ovr_GetTimeInSeconds() - frameinfo->frame_time;
     double time_to_wait =
@@ -220,12 +471,25 @@ void end_frame(RenderEyePose* eye_pose, FrameInfo* frameinfo)
     }
     ovrHmd_EndFrameTiming(m_hmd);
     m_frame_index++;
+#else
+    (void)eye_pose;     // Only the Rift backend timewarps.
+#endif
 }
 
 void deinit()
 {
-    ovrHmd_Destroy(m_hmd);
-    ovr_Shutdown();
+    stop_pose_recording();
+    if (m_pose_trace.ptr)
+    {
+        release(&m_pose_trace);
+    }
+#ifndef PH_HEADLESS
+    if (m_backend == Backend_Rift)
+    {
+        ovrHmd_Destroy(m_hmd);
+        ovr_Shutdown();
+    }
+#endif
 }
 
 }  // ns vr
@@ -40,7 +40,15 @@ struct RenderEyePose
 
 extern ovrHmd  m_hmd;  // 'extern' because abstraction may leak when we try to use direct mode.
 
-void init();
+// Where the HMD constants and the poses come from.
+enum Backend
+{
+    Backend_Rift,           // LibOVR and a Rift. Fatal if there is none.
+    Backend_SimulatedDK2,   // No device. DK2 constants; poses replayed from a
+                            // trace (see load_pose_trace) or standing still.
+};
+
+void init(Backend backend = Backend_Rift);
 
 const HMDConsts get_hmd_constants();
 
@@ -65,9 +73,36 @@ struct FrameInfo
 };
 RenderEyePose begin_frame(FrameInfo* frameinfo);
 
+// `eye_pose` is the pose of the image being shown, which can come from an earlier
+// begin_frame() when rendering is pipelined. Does not wait for the GPU.
 void end_frame(RenderEyePose* eye_pose, FrameInfo* frameinfo);
 
 
+// ---- Pose traces
+// A trace is a text file with one line per frame: the frame time in seconds,
+// relative to the first frame of the trace (whose time is 0), then the left and the right eye pose, each as an
+// orientation (x y z w) and a position (x y z). Lines starting with # are
+// comments. Poses are the ones from the HMD, before the WASD camera moves them.
+
+// Write the poses of every frame from now on to `path`, with either backend.
+// Times are written relative to the first recorded frame, not to the start of
+// the program. Returns false if the file can't be opened.
+bool start_pose_recording(const char* path);
+void stop_pose_recording();
+
+// Simulated backend: frame i of the trace is the pose of the i-th frame after
+// this, and its time the frame time, so runs are repeatable. Times are taken
+// as written, relative to the trace's first frame, so frame times start over
+// from 0 instead of going on from the program's clock. end_frame() does not
+// wait for vsync. When the trace runs out the last pose stays; the caller
+// stops on pose_trace_finished(). Returns false if the file can't be read.
+bool load_pose_trace(const char* path);
+
+// Simulated backend: true once every frame of the trace has been begun.
+bool pose_trace_finished();
+
+// ----
+
 void enable_skybox();
 
 void disable_skybox();
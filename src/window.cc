@@ -112,12 +112,12 @@ void init(const char* title, int width, int height, InitFlag flags)
 #endif
 }
 
-void main_loop(WindowProc step_func)
+void main_loop(WindowProc step_func, StopFunc should_stop)
 {
     //=========================================
     // Main loop.
     //=========================================
-    while (!glfwWindowShouldClose(m_window))
+    while (!glfwWindowShouldClose(m_window) && !(should_stop && should_stop()))
     {
         glfwPollEvents();
 
@@ -22,10 +22,13 @@ enum InitFlag
 };
 
 typedef void (*WindowProc)();
+typedef bool (*StopFunc)();
 
 void init(const char* title, int width, int height, InitFlag flags);
 
-void main_loop(WindowProc step_func);
+// Runs step_func until the window is closed, or until should_stop (if any)
+// returns true.
+void main_loop(WindowProc step_func, StopFunc should_stop = NULL);
 
 void swap_buffers();
 